@@ -1,23 +1,78 @@
 #include <thread>
 #include <fstream>
+#include <cmath>
+#include <algorithm>
 #include <iomanip>
 #include "driver.h"
 #include "json/json.h"
 
+//A trial's row from computeRow, with its own element moved to row: the row
+//solveRow takes when the trial replaces basis[row]
+static SolverRow inRow(const SolverRow& full, uint row)
+{
+    uint n = full.O.rows()-1;
+
+    SolverRow r;
+    r.T = full.T.head(n);   r.T(row) = full.T(n);
+    r.V = full.V.head(n);   r.V(row) = full.V(n);
+    r.O = full.O.head(n);   r.O(row) = full.O(n);
+    return r;
+}
+
+//The same row without the element with basis[row], the row the trial has
+//with the basis of removeRow
+static SolverRow withoutRow(const SolverRow& full, uint row)
+{
+    uint m = full.O.rows()-row-1;
+
+    SolverRow r;
+    r.T.resize(row+m);  r.T << full.T.head(row), full.T.tail(m);
+    r.V.resize(row+m);  r.V << full.V.head(row), full.V.tail(m);
+    r.O.resize(row+m);  r.O << full.O.head(row), full.O.tail(m);
+    return r;
+}
+
 Driver::Driver(System* sys, Solver* sol, SampleSpace* ss)
     : targetState(0)
     , targetEnergy(1111)
     , trialSize(0)
     , numThreads(1)
-    , singularityLimit(5e-14)
+    , rowThreads(1)
+    , orthogonalityLimit(5e-14)
     , forceDiversity(false)
+    , screening(false)
+    , continuation(false)
+    , blockSize(1)
+    , refineCycles(0)
+    , optimizeTrials(0)
+    , optimizeSteps(20)
+    , basisMax(0)
+    , energyTol(0)
+    , energyWindow(50)
+    , residualTol(0)
+    , timeBudget(0)
     , system(sys)
     , solver(sol)
     , sampleSpace(ss)
+    , startTime(std::chrono::steady_clock::now())
 {}
 
 Driver::~Driver()
-{}
+{
+    solver->setThreadPool(nullptr);
+}
+
+//(Re)started whenever numThreads changed since the last use
+ThreadPool& Driver::threadPool()
+{
+    uint threads = std::max(1u,numThreads);
+    if (!pool || pool->size() != threads) {
+        solver->setThreadPool(nullptr);
+        pool.reset(new ThreadPool(threads));
+        solver->setThreadPool(pool.get());
+    }
+    return *pool;
+}
 
 Basis Driver::generateTrials(uint n)
 {
@@ -36,64 +91,103 @@ Basis Driver::generateTrials(uint n)
 
 Basis Driver::generateBasis(uint size, bool rot, real start, real end, uint steps)
 {
-    if (basisCache.eigenvalues.size() != basis.size()) {
-        basisCache = solver->solve(basis);
+    threadPool(); //the solver gets it too
+
+    solver->numStates = targetState+1;
+
+    if ((size_t)basisCache.O.rows() != basis.size()) {
+        basisCache = solver->solve(basis,numThreads);
     }
 
     for (uint s=0; s<size; ++s) {
-        std::cout << basis.size() << " | ";
+        if (!stopReason().empty()) break;
 
-        std::vector<std::pair<CGaussian,complex>*> candidates;
-        std::vector<SolverResults*> caches;
-        std::vector<std::thread> threads;
+        std::cout << basis.size() << " | ";
 
         while (targetEnergy != 1111 &&
             basisCache.eigenvalues.size() > targetState &&
             basisCache.eigenvalues[targetState].real() < targetEnergy) {
                 targetState++;
         }
+        solver->numStates = targetState+1;
 
         std::cout << "target: " << targetState << "  ";
         std::flush(std::cout);
 
+        //The trial budget is shared: every worker takes the next trial from
+        //one queue until it is empty, so a slow trial or a busy core doesn't
+        //hold the others up. With rowThreads > 1 fewer workers run and each
+        //splits its rows over rowThreads cores.
+        uint rthreads     = std::max(1u,std::min(rowThreads,numThreads));
+        uint trialThreads = numThreads/rthreads;
+
+        //Trials are drawn here, the sample space isn't thread safe. With
+        //forceDiversity each batch of trialSize comes from one strain.
+        Basis trials;
         for (uint i=0; i<numThreads; ++i) {
-            candidates.push_back(new std::pair<CGaussian,complex>);
-            caches.push_back(new SolverResults);
-            *caches[i] = basisCache;
-            threads.push_back(
-                    std::thread(Driver::findBestAddition,candidates[i],this,generateTrials(trialSize),
-                                caches[i],targetState,singularityLimit)
-            );
+            Basis batch = generateTrials(trialSize);
+            trials.insert(trials.end(), batch.begin(), batch.end());
         }
+        std::atomic<uint> next(0);
 
-        auto it = threads.begin();
-        for (; it != threads.end(); ++it) {
-            it->join();
+        //The best few are refined and take the place of the whole batch
+        if (optimizeTrials > 0) {
+            trials = optimizeBest(trials,&next,trialThreads,rthreads);
+            next   = 0;
         }
 
-        bool redo = true; //to accomidate the possibility that all trials
-                          //exhibit too much linear dependance.
-
-        CGaussian best = candidates[0]->first;
-        complex   bev  = candidates[0]->second;
-        basisCache = *caches[0];
-        for (uint i=0; i<candidates.size(); ++i) {
-            auto c = candidates[i];
-            if (c->first.A.rows() != 0 && c->second.real() <= bev.real()) {
-                redo = false;
-                best = c->first;
-                bev  = c->second;
-                basisCache = *caches[i];
+        Basis   added;
+        complex bev = 0;
+
+        if (blockSize > 1) {
+            //A block must not overshoot basisMax either
+            uint count = std::min(blockSize,size-s);
+            if (basisMax > 0) {
+                count = std::min<uint>(count,basisMax-basis.size());
+            }
+            bev = addBlock(trials,&next,count,trialThreads,rthreads,added);
+        } else {
+            std::vector<std::pair<CGaussian,complex>*> candidates;
+            std::vector<SolverResults*> caches;
+            for (uint i=0; i<trialThreads; ++i) {
+                candidates.push_back(new std::pair<CGaussian,complex>);
+                caches.push_back(new SolverResults);
+            }
+
+            threadPool().parallelFor(trialThreads,trialThreads,[&](uint i) {
+                findBestAddition(candidates[i],this,trials,&next,caches[i],targetState,
+                                 orthogonalityLimit,rthreads);
+            });
+
+            //Empty if all trials exhibit too much linear dependance
+            uint bi = 0;
+            for (uint i=0; i<candidates.size(); ++i) {
+                auto c = candidates[i];
+                if (c->first.A.rows() != 0 && (added.empty() || c->second.real() <= bev.real())) {
+                    added = {c->first};
+                    bev   = c->second;
+                    bi    = i;
+                }
+            }
+            if (!added.empty()) {
+                basisCache = std::move(*caches[bi]);
+            }
+            for (uint i=0; i<candidates.size(); ++i) {
+                delete candidates[i];
+                delete caches[i];
             }
-            delete c;
-            delete caches[i];
         }
 
-        if (!redo) {
-            basis.push_back(best);
-            convergenceData.push_back(bev);
+        if (!added.empty()) {
+            for (auto& cg : added) {
+                basis.push_back(cg);
+                convergenceData.push_back(bev);
+            }
 
-            std::cout << "strain: " << best.strain << "  ";
+            std::cout << "strain: " << added[0].strain << "  ";
+            if (added.size() > 1) {
+                std::cout << "added: " << added.size() << "  ";
+            }
 
             if (basis.size() > targetState + 1) {
                 std::cout << "E = " << std::setprecision(18) << bev << "\n";
@@ -103,13 +197,16 @@ Basis Driver::generateBasis(uint size, bool rot, real start, real end, uint step
 
             if (rot) {
                 if (sweepMetaData == std::make_tuple(start,end,steps)) {
-                    updateSweep(basis.size()-1);
+                    extendSweep(basis.size()-added.size());
                 } else {
                     sweepAngle(start,end,steps);
                 }
             }
 
-            sampleSpace->learn(best,0);
+            for (auto& cg : added) {
+                sampleSpace->learn(cg,0);
+            }
+            s += added.size()-1;
 
         } else {
             std::cout << "REDO: Too much linear dependance.\n";
@@ -121,61 +218,419 @@ Basis Driver::generateBasis(uint size, bool rot, real start, real end, uint step
     return basis;
 }
 
-void Driver::findBestAddition(std::pair<CGaussian,complex>* out, Driver* driver, Basis trials,
-                              SolverResults* bcache, uint target, real singularityLimit)
+std::string Driver::stopReason()
 {
-    CGaussian best;
-    complex lowestEV = complex(0,0);
+    if (basisMax > 0 && basis.size() >= basisMax) {
+        return "basis size " + std::to_string(basis.size());
+    }
+
+    if (timeBudget > 0) {
+        std::chrono::duration<real> elapsed = std::chrono::steady_clock::now() - startTime;
+        if (elapsed.count() >= timeBudget) {
+            return "time budget, " + std::to_string(elapsed.count()) + "s";
+        }
+    }
+
+    uint w = energyWindow;
+    uint k = convergenceData.size();
+    if (w == 0) return "";
 
-    SolverResults cache = *bcache;
+    if (energyTol > 0 && k > w) {
+        real change = std::abs(convergenceData[k-1].real() - convergenceData[k-1-w].real());
+        if (change < energyTol) {
+            return "energy change " + std::to_string(change) + " over "
+                 + std::to_string(w) + " functions";
+        }
+    }
 
-    if (target >= driver->basis.size())
-        target  = driver->basis.size();
+    //If the gain per window shrinks by a factor r, what's left is d2 r/(1-r)
+    if (residualTol > 0 && k > 2*w) {
+        real d1 = convergenceData[k-1-w].real() - convergenceData[k-1-2*w].real();
+        real d2 = convergenceData[k-1].real()   - convergenceData[k-1-w].real();
+        real r  = d2/d1;
 
-    out->first.A.resize(0,0); //"uninitialized" used for redo check
+        if (r > 0 && r < 1 && std::abs(d2*r/(1-r)) < residualTol) {
+            return "extrapolated residual " + std::to_string(std::abs(d2*r/(1-r)));
+        }
+    }
+
+    return "";
+}
+
+void Driver::refineBasis(uint cycles)
+{
+    threadPool(); //the solver gets it too
 
-    std::stack< std::tuple<CGaussian,complex,SolverResults> > stack;
+    //Nothing to replace, and no target eigenvalue to compare against
+    if (basis.empty()) return;
 
-    for (auto cg : trials) {
-        Basis test = driver->basis;
-        test.push_back(cg);
+    solver->numStates = targetState+1;
 
-        cache = driver->solver->solveRow(test,cache,test.size()-1);
+    if ((size_t)basisCache.O.rows() != basis.size()) {
+        basisCache = solver->solve(basis,numThreads);
+    }
+
+    uint rthreads     = std::max(1u,std::min(rowThreads,numThreads));
+    uint trialThreads = numThreads/rthreads;
+
+    for (uint c=0; c<cycles; ++c) {
+        uint replaced = 0;
+
+        for (uint row=0; row<basis.size(); ++row) {
+            uint target = std::min<uint>(targetState,basisCache.eigenvalues.size()-1);
+
+            Basis trials;
+            for (uint i=0; i<numThreads; ++i) {
+                Basis batch = generateTrials(trialSize);
+                trials.insert(trials.end(), batch.begin(), batch.end());
+            }
+            std::atomic<uint> next(0);
 
-        std::vector<complex> ev = cache.eigenvalues;
-        if (lowestEV == complex(0,0) || ev[target].real() < lowestEV.real()) {
-            stack.push(
-                    std::make_tuple(cg,ev[target],cache)
-            );
-            lowestEV = ev[target];
+            //The trials are screened against the basis without basis[row],
+            //one O(n^3) solve per row instead of one per trial
+            SolverResults reduced = solver->removeRow(basisCache,row);
+
+            std::vector<std::vector<Candidate>> found(trialThreads);
+            threadPool().parallelFor(trialThreads,trialThreads,[&](uint i) {
+                findBestReplacement(&found[i],this,trials,&next,&reduced,row,target,
+                                    orthogonalityLimit,rthreads);
+            });
+
+            std::vector<Candidate> ranked;
+            for (auto& f : found) {
+                for (auto& c : f) ranked.push_back(std::move(c));
+            }
+            std::sort(ranked.begin(), ranked.end(), [](const Candidate& a, const Candidate& b) {
+                return a.energy.real() < b.energy.real();
+            });
+
+            //The screened energies are exact, so only the lowest trial is
+            //solved in full, if it beats basis[row]
+            complex current = basisCache.eigenvalues[target];
+            if (!ranked.empty() && ranked[0].energy.real() < current.real()) {
+                const Candidate& c = ranked[0];
+
+                SolverResults cache = solver->solveRow(basisCache,inRow(c.row,row),row);
+                if (cache.eigenvalues[target].real() < current.real()) {
+                    basis[row] = trials[c.trial];
+                    basisCache = std::move(cache);
+                    sampleSpace->learn(basis[row],0);
+                    replaced++;
+                }
+            }
         }
+
+        std::cout << "refine " << c << " | replaced: " << replaced << "  E = "
+                  << std::setprecision(18) << basisCache.eigenvalues[std::min<uint>(targetState,basisCache.eigenvalues.size()-1)]
+                  << "\n";
     }
+}
+
+complex Driver::addBlock(const Basis& trials, std::atomic<uint>* next, uint count,
+                         uint trialThreads, uint rowThreads, Basis& added)
+{
+    //Some of the lowest trials may turn out dependent, keep spares
+    std::vector<Candidate> ranked = rankTrials(trials,next,2*count,trialThreads,rowThreads);
+
+    //Going down the ranking, a trial is kept if its component orthogonal to
+    //the basis and to the trials kept so far is large enough. With L y = o
+    //the components orthogonal to the basis have the Gram matrix
+    //G_ab = o_ab - y_a.y_b, whose Cholesky factor R grows with every trial kept.
+    uint n = basis.size();
+
+    std::vector<VectorXr>  ys;
+    std::vector<SolverRow> rows;
+    MatrixXr R(0,0);
+
+    for (auto& c : ranked) {
+        if (added.size() == count) break;
 
-    while (!stack.empty()) {
-        auto candidate = stack.top();
-        MatrixXr& O    = std::get<2>(candidate).O;
+        const CGaussian& cg = trials[c.trial];
+        uint m = added.size();
 
-        //Make sure there's not too much linear dependance
-        Eigen::JacobiSVD<MatrixXr> svd(O);
-        real lowestSV = svd.singularValues()(0);
-        for (uint i=0; i<svd.singularValues().rows(); ++i) {
-            if (svd.singularValues()(i) < lowestSV) lowestSV = svd.singularValues()(i);
+        //Elements with the trials kept so far, and with itself
+        SolverRow cross = solver->computeRow(added,cg,rowThreads);
+
+        VectorXr y = c.row.O.head(n);
+        basisCache.L.triangularView<Eigen::Lower>().solveInPlace(y);
+
+        VectorXr z(m);
+        for (uint a=0; a<m; ++a) {
+            z(a) = cross.O(a) - ys[a].dot(y);
         }
+        R.triangularView<Eigen::Lower>().solveInPlace(z);
+
+        real residual = c.row.O(n) - y.squaredNorm() - z.squaredNorm();
+        if (!(residual / c.row.O(n) > orthogonalityLimit)) continue;
+
+        R.conservativeResize(m+1,m+1);
+        R.row(m).head(m) = z.transpose();
+        R.col(m).head(m).setZero();
+        R(m,m) = std::sqrt(residual);
+        ys.push_back(y);
+
+        SolverRow r;
+        r.T.resize(n+m+1);  r.T << c.row.T.head(n), cross.T;
+        r.V.resize(n+m+1);  r.V << c.row.V.head(n), cross.V;
+        r.O.resize(n+m+1);  r.O << c.row.O.head(n), cross.O;
+        rows.push_back(std::move(r));
+        added.push_back(cg);
+    }
 
-        if (lowestSV > singularityLimit) {
-            out->first  = std::get<0>(candidate);
-            out->second = std::get<1>(candidate);
-            *bcache     = std::get<2>(candidate);
+    if (added.empty()) return complex(0,0);
 
-            break;
+    basisCache = solver->solveRows(basisCache,rows);
+
+    uint target = std::min<uint>(targetState,basisCache.eigenvalues.size()-1);
+    return basisCache.eigenvalues[target];
+}
+
+std::vector<Driver::Candidate> Driver::rankTrials(const Basis& trials, std::atomic<uint>* next, uint count,
+                                                 uint trialThreads, uint rowThreads)
+{
+    std::vector<std::vector<Candidate>> found(trialThreads);
+    threadPool().parallelFor(trialThreads,trialThreads,[&](uint i) {
+        findBestTrials(&found[i],this,trials,next,targetState,count,rowThreads);
+    });
+
+    std::vector<Candidate> ranked;
+    for (auto& f : found) {
+        for (auto& c : f) ranked.push_back(std::move(c));
+    }
+    std::sort(ranked.begin(), ranked.end(), [](const Candidate& a, const Candidate& b) {
+        return a.energy.real() < b.energy.real();
+    });
+
+    return ranked;
+}
+
+Basis Driver::optimizeBest(const Basis& trials, std::atomic<uint>* next,
+                           uint trialThreads, uint rowThreads)
+{
+    std::vector<Candidate> ranked = rankTrials(trials,next,optimizeTrials,trialThreads,rowThreads);
+
+    Basis best;
+    for (uint i=0; i<ranked.size() && i<optimizeTrials; ++i) {
+        best.push_back(trials[ranked[i].trial]);
+    }
+
+    threadPool().parallelFor(best.size(),trialThreads,[&](uint i) {
+        optimizeTrial(best[i],targetState,rowThreads);
+    });
+
+    return best;
+}
+
+void Driver::optimizeTrial(CGaussian& trial, uint target, uint rowThreads)
+{
+    uint N      = trial.widths.rows();
+    uint params = N*(N-1)/2;
+
+    //The parameters are the logarithms of the widths, which keeps them positive
+    VectorXr x(params);
+    uint p = 0;
+    for (uint i=0; i<N; ++i) {
+        for (uint j=0; j<i; ++j, ++p) {
+            x(p) = std::log(trial.widths(i,j));
         }
+    }
+
+    auto build = [&](const VectorXr& y) {
+        CGaussian cg = trial;
+        uint q = 0;
+        for (uint i=0; i<N; ++i) {
+            for (uint j=0; j<i; ++j, ++q) {
+                cg.widths(i,j) = std::exp(y(q));
+                cg.widths(j,i) = cg.widths(i,j);
+            }
+        }
+        MatrixStrain::computeCG(&cg,system);
+        MatrixStrain::symmetrize(&cg,system);
+        return cg;
+    };
+
+    //Screened energy and its gradient, NaN if cg is too dependent on the basis
+    auto energy = [&](const CGaussian& cg, VectorXr& gradient) {
+        SolverRowGradient grad;
+        SolverRow r = solver->computeRow(basis,cg,grad,rowThreads);
+
+        if (!(solver->orthogonality(basisCache,r) > orthogonalityLimit)) {
+            return real(NAN);
+        }
+
+        real E = solver->screenRow(basisCache,r,target,grad,gradient).real();
+        return gradient.allFinite() ? E : real(NAN);
+    };
+
+    VectorXr g;
+    real     f = energy(trial,g);
+    if (std::isnan(f)) return;
+
+    //Inverse Hessian estimate
+    MatrixXr H = MatrixXr::Identity(params,params);
 
-        stack.pop();
+    for (uint it=0; it<optimizeSteps; ++it) {
+        VectorXr step = -H*g;
+        if (!(g.dot(step) < 0)) {
+            H.setIdentity();
+            step = -g;
+        }
+
+        //No width changes by more than a factor e per step
+        real longest = step.lpNorm<Eigen::Infinity>();
+        if (longest > 1) step /= longest;
+
+        //Backtracking until the Armijo condition holds
+        real      t = 1;
+        bool      accepted = false;
+        CGaussian cg;
+        VectorXr  gnew;
+        real      fnew = NAN;
+        for (uint k=0; k<10 && !accepted; ++k) {
+            cg       = build(x+t*step);
+            fnew     = energy(cg,gnew);
+            accepted = fnew <= f + 1e-4*t*g.dot(step);
+            if (!accepted) t /= 2;
+        }
+        if (!accepted) break;
+
+        VectorXr s = t*step;
+        VectorXr y = gnew-g;
+        real     sy = s.dot(y);
+        if (sy > 0) {
+            if (it == 0) H *= sy/y.squaredNorm();
+
+            MatrixXr I = MatrixXr::Identity(params,params);
+            H = (I - s*y.transpose()/sy) * H * (I - y*s.transpose()/sy) + s*s.transpose()/sy;
+        }
+
+        real gain = f-fnew;
+        x    += s;
+        g     = gnew;
+        f     = fnew;
+        trial = cg;
+
+        if (gain <= 1e-12*std::abs(f)) break;
     }
 }
 
+void Driver::findBestTrials(std::vector<Candidate>* out, Driver* driver, const Basis& trials,
+                            std::atomic<uint>* next, uint target, uint count, uint rowThreads)
+{
+    const Basis&         basis  = driver->basis;
+    const SolverResults& bcache = driver->basisCache;
+
+    if (target >= basis.size())
+        target  = basis.size();
+
+    auto lower = [](const Candidate& a, const Candidate& b) {
+        return a.energy.real() < b.energy.real();
+    };
+
+    for (uint k=(*next)++; k<trials.size(); k=(*next)++) {
+        SolverRow row = driver->solver->computeRow(basis,trials[k],rowThreads);
+
+        complex ev;
+        if (driver->screening) {
+            ev = driver->solver->screenRow(bcache,row,target);
+        } else {
+            ev = driver->solver->solveRow(bcache,row,basis.size()).eigenvalues[target];
+        }
+
+        if (std::isnan(ev.real())) continue;
+        if (out->size() == count && ev.real() >= out->back().energy.real()) continue;
+
+        Candidate c = {k,ev,std::move(row)};
+        out->insert(std::upper_bound(out->begin(),out->end(),c,lower), std::move(c));
+        if (out->size() > count) out->pop_back();
+    }
+}
+
+void Driver::findBestReplacement(std::vector<Candidate>* out, Driver* driver, const Basis& trials,
+                                 std::atomic<uint>* next, const SolverResults* reduced, uint row,
+                                 uint target, real orthogonalityLimit, uint rowThreads)
+{
+    const Basis& basis = driver->basis;
+
+    for (uint k=(*next)++; k<trials.size(); k=(*next)++) {
+        SolverRow full = driver->solver->computeRow(basis,trials[k],rowThreads);
+        SolverRow r    = withoutRow(full,row);
+
+        //Dependent trials first, their energies are unreliable
+        if (!(driver->solver->orthogonality(*reduced,r) > orthogonalityLimit)) {
+            continue;
+        }
+
+        complex ev = driver->solver->screenRow(*reduced,r,target);
+        if (!std::isnan(ev.real()) &&
+            (out->empty() || ev.real() < out->back().energy.real())) {
+            out->push_back({k,ev,std::move(full)});
+        }
+    }
+}
+
+void Driver::findBestAddition(std::pair<CGaussian,complex>* out, Driver* driver, const Basis& trials,
+                              std::atomic<uint>* next, SolverResults* result, uint target,
+                              real orthogonalityLimit, uint rowThreads)
+{
+    const Basis&         basis  = driver->basis;
+    const SolverResults& bcache = driver->basisCache;
+
+    if (target >= basis.size())
+        target  = basis.size();
+
+    out->first.A.resize(0,0); //"uninitialized" used for redo check
+
+    //The lowest trial so far that is independent enough. The dependance check
+    //comes first so a nearly dependent trial, whose energy is unreliable,
+    //can't hide the ones after it. Only the row is kept with screening, the
+    //full results are rebuilt for the winner; without they are at hand.
+    Candidate     best  = {0,complex(NAN,0),SolverRow()};
+    bool          found = false;
+    SolverResults lowest;
+
+    for (uint k=(*next)++; k<trials.size(); k=(*next)++) {
+        SolverRow row = driver->solver->computeRow(basis,trials[k],rowThreads);
+
+        //Make sure there's not too much linear dependance: the norm of the new
+        //function's component orthogonal to the basis, relative to its own
+        if (!(driver->solver->orthogonality(bcache,row) > orthogonalityLimit)) {
+            continue;
+        }
+
+        complex       ev;
+        SolverResults cache;
+        if (driver->screening) {
+            ev = driver->solver->screenRow(bcache,row,target);
+        } else {
+            cache = driver->solver->solveRow(bcache,row,basis.size());
+            ev    = cache.eigenvalues[target];
+        }
+
+        if (!std::isnan(ev.real()) && (!found || ev.real() < best.energy.real())) {
+            best  = {k,ev,std::move(row)};
+            found = true;
+            if (!driver->screening) lowest = std::move(cache);
+        }
+    }
+
+    if (!found) return;
+
+    if (driver->screening) {
+        *result     = driver->solver->solveRow(bcache,best.row,basis.size());
+        best.energy = result->eigenvalues[target];
+    } else {
+        *result     = std::move(lowest);
+    }
+
+    out->first  = trials[best.trial];
+    out->second = best.energy;
+}
+
 void Driver::sweepAngle(real start, real end, uint steps)
 {
+    threadPool(); //the solver gets it too
+
     assert (basis.size() > 0);
 
     //sweepMetaData = std::make_tuple(start,end,steps);
@@ -183,76 +638,92 @@ void Driver::sweepAngle(real start, real end, uint steps)
 
     real stepsize = (end-start)/(real)steps;
 
-    if (basisCache.eigenvalues.size() != basis.size()) {
-        basisCache = solver->solve(basis);
+    if ((size_t)basisCache.O.rows() != basis.size()) {
+        basisCache = solver->solve(basis,numThreads);
     }
 
-    if (numThreads == 1) {
-        for (uint i=0; i<steps; ++i) {
+    solver->prepareRot(basis,numThreads);
+
+    //Only the start angle is solved in full, its selected eigenvalues are
+    //then followed from angle to angle
+    if (continuation && solver->rotVectors) {
+        std::cout << 0 << " Solve angle " << start << "\n";
+        sweepData[start] = solver->solveRot(basis,start,basisCache,numThreads);
+
+        real prev = start;
+        for (uint i=1; i<steps; ++i) {
             real theta = start + stepsize*i;
-            std::cout << i << " Solve angle " << theta << "\n";
+            std::cout << i << " Continue angle " << theta << "\n";
 
-            sweepData[theta] = solver->solveRot(basis,theta,basisCache);
+            sweepData[theta] = solver->continueRot(basis,theta,sweepData[prev],prev,numThreads);
+            prev = theta;
         }
-    } else {
-        for (uint i=0; i<steps; ++i) {
-            std::vector<std::thread> threads;
+        return;
+    }
 
-            for(uint n=0; n<numThreads; ++n) {
-                real theta = start + stepsize*i;
+    //Map entries are made up front, the solves only fill them in. With fewer
+    //angles than threads the spare threads go to each solve.
+    std::vector<real>           angles;
+    std::vector<SolverResults*> slots;
+    for (uint i=0; i<steps; ++i) {
+        real theta = start + stepsize*i;
+        std::cout << i << " Solve angle " << theta << "\n";
 
-                if (i >= steps) break;
+        angles.push_back(theta);
+        slots.push_back(&sweepData[theta]);
+    }
 
-                std::cout << i << " Solve angle " << theta << "\n";
-                threads.push_back(threadify(
-                                  &Solver::solveRot,&sweepData[theta],solver,basis,theta,basisCache));
-                i++;
-            }
-            i--;
+    uint perSolver = std::max(1u,numThreads/std::max(1u,std::min(numThreads,steps)));
 
-            auto it = threads.begin();
-            for (; it != threads.end(); ++it) {
-                it->join();
-            }
-        }
-    }
+    threadPool().parallelFor(steps,numThreads,[&](uint i) {
+        *slots[i] = solver->solveRot(basis,angles[i],basisCache,perSolver);
+    });
 }
 
 void Driver::updateSweep(uint row)
 {
+    threadPool(); //the solver gets it too
+
     assert (basis.size() > 0);
 
-    auto i = sweepData.begin();
+    solver->prepareRot(basis,numThreads);
 
-    if (numThreads == 1) {
-        for (; i != sweepData.end(); ++i) {
-            real theta = i->first;
-            SolverResults& cache = i->second;
+    std::vector<real>           angles;
+    std::vector<SolverResults*> slots;
+    for (auto& kv : sweepData) {
+        angles.push_back(kv.first);
+        slots.push_back(&kv.second);
+    }
 
-            sweepData[theta] = solver->solveRotRow(basis,theta,cache,row);
-        }
-    } else {
-        for (; i != sweepData.end(); ++i) {
-            std::vector<std::thread> threads;
+    uint count     = slots.size();
+    uint perSolver = std::max(1u,numThreads/std::max(1u,std::min(numThreads,count)));
+
+    threadPool().parallelFor(count,numThreads,[&](uint i) {
+        *slots[i] = solver->solveRotRow(basis,angles[i],*slots[i],row,perSolver);
+    });
+}
 
-            for(uint n=0; n<numThreads; ++n) {
-                if (i == sweepData.end()) break;
+void Driver::extendSweep(uint first)
+{
+    threadPool(); //the solver gets it too
 
-                real theta = i->first;
-                SolverResults& cache = i->second;
+    assert (basis.size() > 0);
 
-                threads.push_back(threadify(
-                                  &Solver::solveRotRow,&sweepData[theta],solver,basis,theta,cache,row));
-                ++i;
-            }
-            --i;
+    solver->prepareRot(basis,numThreads);
 
-            auto it = threads.begin();
-            for (; it != threads.end(); ++it) {
-                it->join();
-            }
-        }
+    std::vector<real>           angles;
+    std::vector<SolverResults*> slots;
+    for (auto& kv : sweepData) {
+        angles.push_back(kv.first);
+        slots.push_back(&kv.second);
     }
+
+    uint count     = slots.size();
+    uint perSolver = std::max(1u,numThreads/std::max(1u,std::min(numThreads,count)));
+
+    threadPool().parallelFor(count,numThreads,[&](uint i) {
+        *slots[i] = solver->solveRotRows(basis,angles[i],*slots[i],first,perSolver);
+    });
 }
 
 void Driver::writeBasis(std::string file)
@@ -344,6 +815,7 @@ void Driver::readBasis(std::string file, uint n, bool append)
         cg.A      = A;
         cg.widths = widths;
         cg.norm   = entry["norm"].asDouble();
+        MatrixStrain::symmetrize(&cg,system);
 
         newBasis.push_back(cg);
     }
@@ -380,10 +852,34 @@ void Driver::writeSweepData(std::string file)
     datafile.close();
 }
 
+//One line per angle and selected eigenvalue: theta, E, then the basis coefficients
+void Driver::writeResonanceData(std::string file)
+{
+    std::ofstream datafile;
+    datafile.open(file, std::ofstream::out);
+
+    for (auto& kv : sweepData) {
+        const SolverResults& rot = kv.second;
+        for (uint k=0; k<rot.selected.size(); ++k) {
+            complex E = rot.eigenvalues[rot.selected[k]];
+            datafile << kv.first << "\t" << E.real() << " " << E.imag();
+            for (int i=0; i<rot.rotEigenvectors[k].rows(); ++i) {
+                datafile << "\t" << rot.rotEigenvectors[k](i).real()
+                         << " "  << rot.rotEigenvectors[k](i).imag();
+            }
+            datafile << "\n";
+        }
+    }
+
+    datafile.close();
+}
+
 void Driver::printEnergies(uint n)
 {
-    if (basisCache.eigenvalues.size() != basis.size()) {
-        basisCache = solver->solve(basis);
+    threadPool(); //the solver gets it too
+
+    if ((size_t)basisCache.O.rows() != basis.size()) {
+        basisCache = solver->solve(basis,numThreads);
     }
 
     for (uint i=0; i<basisCache.eigenvalues.size() && i<n; ++i) {
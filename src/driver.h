@@ -3,10 +3,12 @@
 #define DRIVER_H
 
 #include <map>
+#include <chrono>
 #include "typedefs.h"
 #include "system.h"
 #include "sampling.h"
 #include "solver.h"
+#include "threadpool.h"
 
 class Driver
 {
@@ -17,21 +19,51 @@ public:
     Basis generateTrials(uint size);
     Basis generateBasis(uint size, bool rot=false, real start=0, real end=0, uint steps=0);
 
+    //Walks over the basis cycles times and replaces each function by the best
+    //of a batch of random trials if that lowers the target energy
+    void refineBasis(uint cycles);
+
+    //Empty while generation should go on, otherwise the first stopping
+    //criterion that is met. generateBasis checks it before every step.
+    std::string stopReason();
+
     void sweepAngle(real start, real end, uint steps);
     void updateSweep(uint row);
+    //Every angle of the sweep gains the functions from first on at once
+    void extendSweep(uint first);
 
     void readBasis(std::string file, uint n=0, bool append=false);
     void writeBasis(std::string file);
     void writeConvergenceData(std::string file);
     void writeSweepData(std::string file);
+    void writeResonanceData(std::string file);
     void printEnergies(uint n);
 
     int  targetState;
     real targetEnergy;
     uint trialSize;
     uint numThreads;
-    real singularityLimit;
+    uint rowThreads; //threads splitting each trial row
+    //Least l_nn^2/o_nn a new function may have: the squared norm of its component
+    //orthogonal to the basis, relative to its own. Not the smallest singular
+    //value of O the old singularityLimit bounded, see init() in main.cpp.
+    real orthogonalityLimit;
     bool forceDiversity;
+    bool screening; //rank trials by the secular equation, diagonalize only the winner
+                    //(replacements in refineBasis always are, exactly)
+    bool continuation; //sweeps follow the solver's vectorWindow eigenvalues in theta
+    uint blockSize; //functions accepted per generation step, >1 adds a block at once
+    uint refineCycles; //refineBasis passes after generation
+    uint optimizeTrials; //best trials per step whose widths are refined by BFGS, the
+                         //only ones left to add, so also a cap on blockSize
+    uint optimizeSteps;  //BFGS iterations per refined trial
+
+    //Stopping criteria, zero disables one
+    uint basisMax;     //basis size
+    real energyTol;    //target energy change over the last energyWindow additions
+    uint energyWindow;
+    real residualTol;  //remaining gain, extrapolated geometrically from the last two windows
+    real timeBudget;   //wall-clock seconds since the driver was created
 
 private:
     System*      system;
@@ -45,8 +77,56 @@ private:
     std::map<real,SolverResults> sweepData;
     std::tuple<real,real,uint> sweepMetaData; //start,end,steps
 
-    static void findBestAddition(std::pair<CGaussian,complex>* out,Driver*,Basis trails,
-                                 SolverResults* bcache,uint target,real singularityLimit);
+    std::chrono::steady_clock::time_point startTime;
+
+    //numThreads sized, shared with the solver
+    std::unique_ptr<ThreadPool> pool;
+    ThreadPool& threadPool();
+
+    //A trial with its row against the basis and the target energy it gives
+    struct Candidate {
+        uint      trial;
+        complex   energy;
+        SolverRow row;
+    };
+
+    //Block mode: up to count of the lowest trials that stay independent of the
+    //basis and of each other are appended to basisCache with one solveRows.
+    //Returns the new target energy, added gets the accepted functions.
+    complex addBlock(const Basis& trials, std::atomic<uint>* next, uint count,
+                     uint trialThreads, uint rowThreads, Basis& added);
+
+    //The lowest count trials of every worker's share of the queue, merged and sorted
+    std::vector<Candidate> rankTrials(const Basis& trials, std::atomic<uint>* next, uint count,
+                                      uint trialThreads, uint rowThreads);
+
+    //The optimizeTrials lowest of the trials left in the queue, each refined by
+    //optimizeTrial on one of trialThreads workers
+    Basis optimizeBest(const Basis& trials, std::atomic<uint>* next,
+                       uint trialThreads, uint rowThreads);
+
+    //Lowers the screened target energy of trial by BFGS over the logarithms of
+    //its widths, with analytic gradients. Steps that make it too dependent on
+    //the basis are rejected.
+    void optimizeTrial(CGaussian& trial, uint target, uint rowThreads);
+
+    //Keeps the count lowest of the trials taken from the shared queue, sorted
+    static void findBestTrials(std::vector<Candidate>* out,Driver*,const Basis& trials,
+                               std::atomic<uint>* next,uint target,uint count,uint rowThreads);
+
+    //Every independent trial from the shared queue that improved on the ones
+    //before it as a replacement of basis[row], screened against reduced, the
+    //basisCache without that function. The rows are kept against the whole basis.
+    static void findBestReplacement(std::vector<Candidate>* out,Driver*,const Basis& trials,
+                                    std::atomic<uint>* next,const SolverResults* reduced,uint row,
+                                    uint target,real orthogonalityLimit,uint rowThreads);
+
+    //Takes trials[next++] until the shared queue runs dry. All workers read
+    //the driver's basis and basisCache, only the accepted trial's results are
+    //written to result.
+    static void findBestAddition(std::pair<CGaussian,complex>* out,Driver*,const Basis& trials,
+                                 std::atomic<uint>* next,SolverResults* result,uint target,
+                                 real orthogonalityLimit,uint rowThreads);
 };
 
 #endif
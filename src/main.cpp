@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <ctime>
+#include <algorithm>
 #include "tclap/CmdLine.h"
 #include "json/json.h"
 #include "typedefs.h"
@@ -78,17 +79,29 @@ int main(int argc, char* argv[])
 
     std::cout << "Let's go!\n";
 
-    for (int i=0; i<8000; ++i) {
-        driver->generateBasis(1);
+    std::string reason;
+    //A call adds up to blockSize functions in one step, they are written
+    //out together
+    while ((reason = driver->stopReason()).empty()) {
+        driver->generateBasis(std::max(1u,driver->blockSize));
         driver->writeConvergenceData(outdir+"/convergence.dat");
         driver->writeBasis(outdir+"/basis.json");
         //driver->generateBasis(1,true,0,pi/3,100);
         //driver->readBasis(basisFile,i);
     }
 
+    std::cout << "Stopping: " << reason << "\n";
+
+    if (driver->refineCycles > 0) {
+        driver->refineBasis(driver->refineCycles);
+    }
+
     driver->writeBasis(outdir+"/basis.json");
     driver->sweepAngle(0,pi/8,100);
     driver->writeSweepData(outdir+"/sweep"+std::to_string(num)+".dat");
+    if (solver->rotVectors) {
+        driver->writeResonanceData(outdir+"/resonances"+std::to_string(num)+".dat");
+    }
 
     driver->printEnergies(10);
 
@@ -165,6 +178,28 @@ void init(std::string file, System*& system, Solver*& solver, SampleSpace*& spac
 
     std::cout << "Parsing Solver\n";
 
+    const Json::Value JSolver = root["solver"];
+    solver->iterative        = JSolver.get("iterative",false).asBool();
+    solver->complexSymmetric = JSolver.get("complexSymmetric",false).asBool();
+    solver->rotCacheMB       = JSolver.get("rotCacheMB",2048).asDouble();
+
+    //[min Re E, max Re E, min Im E, max Im E] of the rotated eigenvectors to compute
+    const Json::Value JWindow = JSolver["vectorWindow"];
+    if (JWindow.size() == 4) {
+        solver->rotVectors   = true;
+        solver->vectorWindow = {JWindow[0].asDouble(), JWindow[1].asDouble(),
+                                JWindow[2].asDouble(), JWindow[3].asDouble()};
+    }
+
+    //Same layout, only the rotated eigenvalues inside are computed
+    const Json::Value JSlice = JSolver["sliceWindow"];
+    if (JSlice.size() == 4) {
+        solver->slicing     = true;
+        solver->sliceWindow = {JSlice[0].asDouble(), JSlice[1].asDouble(),
+                               JSlice[2].asDouble(), JSlice[3].asDouble()};
+        solver->slices      = JSolver.get("slices",1).asInt();
+    }
+
     //========== PARSE SAMPLE SPACE =======
     space = new SampleSpace();
 
@@ -226,10 +261,31 @@ void init(std::string file, System*& system, Solver*& solver, SampleSpace*& spac
     std::cout << "Parsing Driver\n";
 
     const Json::Value JDriver = root["driver"];
-    driver->targetState      = JDriver.get("targetState",0).asInt();
-    driver->targetEnergy     = JDriver.get("targetEnergy",1111).asDouble();
-    driver->trialSize        = JDriver.get("trialSize",1).asInt();
-    driver->numThreads       = JDriver.get("threads",1).asInt();
-    driver->singularityLimit = JDriver.get("singularityLimit",5e-15).asDouble();
-    driver->forceDiversity   = JDriver.get("forceDiversity",0).asInt();
+    driver->targetState        = JDriver.get("targetState",0).asInt();
+    driver->targetEnergy       = JDriver.get("targetEnergy",1111).asDouble();
+    driver->trialSize          = JDriver.get("trialSize",1).asInt();
+    driver->numThreads         = JDriver.get("threads",1).asInt();
+    driver->rowThreads         = JDriver.get("rowThreads",1).asInt();
+    driver->orthogonalityLimit = JDriver.get("orthogonalityLimit",5e-15).asDouble();
+    driver->forceDiversity     = JDriver.get("forceDiversity",0).asInt();
+    driver->screening          = JDriver.get("screening",false).asBool();
+    driver->continuation       = JDriver.get("continuation",false).asBool();
+    driver->blockSize          = JDriver.get("blockSize",1).asInt();
+    driver->refineCycles       = JDriver.get("refineCycles",0).asInt();
+    driver->optimizeTrials     = JDriver.get("optimizeTrials",0).asInt();
+    driver->optimizeSteps      = JDriver.get("optimizeSteps",20).asInt();
+    driver->basisMax           = JDriver.get("basisMax",8000).asInt();
+    driver->energyTol          = JDriver.get("energyTol",0).asDouble();
+    driver->energyWindow       = JDriver.get("energyWindow",50).asInt();
+    driver->residualTol        = JDriver.get("residualTol",0).asDouble();
+    driver->timeBudget         = JDriver.get("timeBudget",0).asDouble();
+
+    //singularityLimit bounded the smallest singular value of the whole O, the
+    //relative test that replaced it is weaker at the same value. Old configs
+    //still run with their limit taken over, but should be retuned.
+    if (!JDriver.isMember("orthogonalityLimit") && JDriver.isMember("singularityLimit")) {
+        driver->orthogonalityLimit = JDriver["singularityLimit"].asDouble();
+        std::cout << "WARNING: singularityLimit is obsolete, using it as orthogonalityLimit = "
+                  << driver->orthogonalityLimit << "\n";
+    }
 }
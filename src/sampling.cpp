@@ -105,24 +105,54 @@ void MatrixStrain::computeCG(CGaussian* cg, System* sys)
     assert(cg->widths.rows() == cg->widths.cols());
 #endif
     uint N = cg->widths.rows();
-    cg->A.resize(N-1,N-1);
-
-    for (uint k=0; k<N-1; ++k) {
-        for (uint l=0; l<N-1; ++l) {
-            real A_kl = 0;
-            for (uint i=0; i<N; ++i) {
-                for (uint j=0; j<i; ++j) {
-                    VectorXr w = sys->omega(i,j);
-                    A_kl += 1/(cg->widths(i,j)*cg->widths(i,j)) * w(k) * w(l);
-                }
-            }
-            cg->A(k,l) = A_kl;
+    const MatrixXr& W = sys->omegaM();
+
+    //A = W diag(1/r_ij^2) W^T
+    VectorXr d;
+    d.resize(W.cols());
+
+    uint p = 0;
+    for (uint i=0; i<N; ++i) {
+        for (uint j=0; j<i; ++j, ++p) {
+            d(p) = 1/(cg->widths(i,j)*cg->widths(i,j));
         }
     }
 
+    cg->A.noalias() = W * d.asDiagonal() * W.transpose();
+
     cg->norm = std::pow( std::pow(twopi,N-1)/(2*cg->A).determinant() , -3./4.);
 }
 
+void MatrixStrain::symmetrize(CGaussian* cg, System* sys)
+{
+    const std::vector<Permutation>& permutations = sys->getPermutations();
+    uint N = cg->widths.rows();
+
+    std::shared_ptr<SymmetrizedCG> sym(new SymmetrizedCG);
+    sym->nperm = permutations.size();
+
+    //Operate permutations on matrices
+    for (auto& perm : permutations) {
+        MatrixXr P;
+        P.resize(N,N);
+        for (uint i=0; i<N; ++i) {
+            for (uint j=0; j<=i; ++j) {
+                P(i,j) = cg->widths(perm.indices[i],perm.indices[j]);
+                P(j,i) = P(i,j);
+            }
+        }
+
+        CGaussian image;
+        image.widths = P;
+        computeCG(&image,sys);
+
+        sym->images.push_back(image);
+        sym->signs.push_back(perm.sign);
+    }
+
+    cg->sym = sym;
+}
+
 void MatrixStrain::learn(CGaussian& cg, real impact)
 {
     MatrixXr& widths = cg.widths;
@@ -142,6 +172,7 @@ CGaussian MatrixStrain::genMatrix()
     CGaussian out;
     out.widths = genWidths();
     computeCG(&out,system);
+    symmetrize(&out,system);
 
     return out;
 }
@@ -70,6 +70,9 @@ public:
     //Computes A and norm from the widths matrix
     static void computeCG(CGaussian*,System*);
 
+    //Builds the permuted images of a CGaussian, must be called after computeCG
+    static void symmetrize(CGaussian*,System*);
+
     //Generates a new CGaussian according to distributions.
     CGaussian genMatrix();
 
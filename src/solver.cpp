@@ -1,4 +1,5 @@
-#include <set>
+#include <limits>
+#include <cmath>
 #include <algorithm>
 #include "solver.h"
 #include "sampling.h"
@@ -14,380 +15,1387 @@ extern "C" void zggev_(const char* JOBVL, const char* JOBVR, const int* N,
                        fortranComplex16* VL, const int* LDVL, fortranComplex16* VR, const int* LDVR,
                        fortranComplex16* WORK, const int* LWORK, double* RWORK, int* INFO);
 
+//std::complex<double> has the layout of COMPLEX*16
+static inline fortranComplex16* fortran(std::complex<double>* p)
+{
+    return reinterpret_cast<fortranComplex16*>(p);
+}
+
+//zggev buffers, one set per thread as sweeps solve angles concurrently. They
+//only ever grow, so repeated solves at the same or smaller sizes allocate nothing.
+struct QZWorkspace
+{
+    std::vector<std::complex<double>> a; //copy of H, only when real isn't double
+    std::vector<std::complex<double>> b;
+    std::vector<std::complex<double>> alpha;
+    std::vector<std::complex<double>> beta;
+    std::vector<std::complex<double>> work;
+    std::vector<double>               rwork;
+    int lwork   = 0;
+    int queried = -1; //size lwork is the optimal workspace for
+
+    void reserve(int n)
+    {
+        size_t nn = (size_t)n*n;
+        if (b.size() < nn)         b.resize(nn);
+        if (alpha.size() < (size_t)n) {
+            alpha.resize(n);
+            beta.resize(n);
+            rwork.resize(8*n);
+        }
+
+        //Workspace query, lwork = -1 returns the blocked optimum in work[0]
+        if (n != queried) {
+            int info, query = -1;
+            std::complex<double> opt;
+            zggev_("N","N",&n,fortran(b.data()),&n,fortran(b.data()),&n,fortran(alpha.data()),fortran(beta.data()),
+                   nullptr,&n,nullptr,&n,fortran(&opt),&query,rwork.data(),&info);
+
+            lwork   = std::max<int>(std::max(1,2*n), (int)opt.real());
+            queried = n;
+            if (work.size() < (size_t)lwork) work.resize(lwork);
+            else                             lwork = work.size();
+        }
+    }
+};
+
+static thread_local QZWorkspace qzWorkspace;
+
+//Scratch of the element kernels: per term prefactors and c_ij for element(),
+//and the c_ij of every interacting pair for one pairKernel call. Grows like
+//the QZ workspace, so only a thread's first element allocates.
+struct ElementWorkspace
+{
+    std::vector<real> pre;
+    std::vector<real> c;
+    std::vector<real> pairC;
+
+    void reserve(size_t terms, size_t pairs)
+    {
+        if (pre.size() < terms)   pre.resize(terms);
+        if (c.size() < terms)     c.resize(terms);
+        if (pairC.size() < pairs) pairC.resize(pairs);
+    }
+};
+
+static thread_local ElementWorkspace elementWorkspace;
+
+//Hands LAPACK the matrix storage itself in double precision, and a copy
+//in the workspace otherwise
+static inline std::complex<double>* lapackData(std::complex<double>* data, size_t,
+                                               std::vector<std::complex<double>>&)
+{
+    return data;
+}
+
+template<typename T>
+static std::complex<double>* lapackData(std::complex<T>* data, size_t size,
+                                        std::vector<std::complex<double>>& buffer)
+{
+    if (buffer.size() < size) buffer.resize(size);
+    for (size_t i=0; i<size; ++i) {
+        buffer[i] = std::complex<double>(data[i].real(),data[i].imag());
+    }
+    return buffer.data();
+}
+
 Solver::Solver(System* sys)
-    : system(sys)
+    : iterative(false), numStates(0), complexSymmetric(false), rotVectors(false), slicing(false), slices(1), rotCacheMB(2048), system(sys), pool(nullptr)
 {}
 
 Solver::~Solver()
 {}
 
+//Index of element (m,n) in a packed lower triangle
+static inline size_t packed(size_t m, size_t n)
+{
+    return (m >= n) ? m*(m+1)/2 + n : n*(n+1)/2 + m;
+}
+
+//L^-1 H L^-T, the standard form of the unrotated problem
+static MatrixXr reduce(const MatrixXr& H, const MatrixXr& L)
+{
+    MatrixXr Hs = H;
+    L.triangularView<Eigen::Lower>().solveInPlace(Hs);
+    L.triangularView<Eigen::Lower>().transpose().solveInPlace<Eigen::OnTheRight>(Hs);
+    return Hs;
+}
+
+//Cholesky factor of O after its last row and column were appended to the
+//O = LL^T of the previous basis: L y = o, l_nn^2 = o_nn - |y|^2. A dependent
+//function gives a NaN l_nn.
+static MatrixXr extendCholesky(const MatrixXr& L, const VectorXr& o)
+{
+    uint n = L.rows();
+
+    MatrixXr out = MatrixXr::Zero(n+1,n+1);
+    out.topLeftCorner(n,n) = L;
+
+    VectorXr y = o.head(n);
+    L.triangularView<Eigen::Lower>().solveInPlace(y);
+
+    out.row(n).head(n) = y.transpose();
+    out(n,n) = std::sqrt(o(n) - y.squaredNorm());
+
+    return out;
+}
+
+//Hs = L^-1 H L^-T after H gained the last row h, with Lnew the extended L.
+//The old block is kept and with L y = o the new row is
+//  u = (L^-1 h - Hs y)/l_nn,  d = (y^T Hs y - 2 y^T L^-1 h + h_nn)/l_nn^2
+static MatrixXr extendReduced(const MatrixXr& L, const MatrixXr& Hs, const MatrixXr& Lnew,
+                              const VectorXr& h)
+{
+    uint n = L.rows();
+
+    VectorXr y  = Lnew.row(n).head(n).transpose();
+    VectorXr q  = h.head(n);
+    L.triangularView<Eigen::Lower>().solveInPlace(q);
+    VectorXr Hy = Hs.selfadjointView<Eigen::Lower>()*y;
+
+    MatrixXr out(n+1,n+1);
+    out.topLeftCorner(n,n) = Hs;
+    out.col(n).head(n) = (q - Hy)/Lnew(n,n);
+    out.row(n).head(n) = out.col(n).head(n).transpose();
+    out(n,n) = (y.dot(Hy) - 2*y.dot(q) + h(n)) / (Lnew(n,n)*Lnew(n,n));
+
+    return out;
+}
+
+//Cholesky factor of O after its row and column row were removed from the
+//O = LL^T of the previous basis. The rows above keep their factor, the
+//trailing block absorbs the removed column l by the rank one update
+//L33' L33'^T = L33 L33^T + l l^T, a Givens rotation per row.
+static MatrixXr removeCholesky(const MatrixXr& L, uint row)
+{
+    uint n = L.rows();
+    uint m = n-row-1;
+
+    MatrixXr out = MatrixXr::Zero(n-1,n-1);
+    out.topLeftCorner(row,row)  = L.topLeftCorner(row,row);
+    out.bottomLeftCorner(m,row) = L.bottomLeftCorner(m,row);
+    out.bottomRightCorner(m,m)  = L.bottomRightCorner(m,m);
+
+    VectorXr l = L.col(row).tail(m);
+    for (uint k=0; k<m; ++k) {
+        uint j    = row+k;
+        uint rest = m-k-1;
+        real r    = std::hypot(out(j,j),l(k));
+        real c    = r/out(j,j);
+        real s    = l(k)/out(j,j);
+
+        out(j,j) = r;
+        out.col(j).tail(rest) = (out.col(j).tail(rest) + s*l.tail(rest))/c;
+        l.tail(rest)          = c*l.tail(rest) - s*out.col(j).tail(rest);
+    }
+
+    return out;
+}
+
 CpuSolver::CpuSolver(System* sys)
     : Solver(sys)
-{}
+    , rotCached(false)
+{
+    switch (system->getParticles().size()) {
+        case 2:  kernel = &CpuSolver::pairKernel<1>; break;
+        case 3:  kernel = &CpuSolver::pairKernel<2>; break;
+        case 4:  kernel = &CpuSolver::pairKernel<3>; break;
+        case 5:  kernel = &CpuSolver::pairKernel<4>; break;
+        case 6:  kernel = &CpuSolver::pairKernel<5>; break;
+        default: kernel = &CpuSolver::pairKernel<Eigen::Dynamic>; break;
+    }
+
+    //Only gaussian pairs contribute, harmonic pair potentials are not implemented
+    const std::vector<InteractionPair>& pairs = system->getInteractionPairs();
+    for (uint p=0; p<pairs.size(); ++p) {
+        if (pairs[p].type == InteractionV::Gaussian) {
+            gaussPairs.push_back(p);
+            gaussR.push_back(1./(2*pairs[p].r0*pairs[p].r0));
+        }
+    }
+
+    termCount = system->getPermutations().size() * gaussPairs.size();
+}
 
 CpuSolver::~CpuSolver()
 {}
 
-SolverResults CpuSolver::solve(const Basis& basis)
+SolverResults CpuSolver::solve(const Basis& basis, uint threads)
 {
-    const std::vector<Particle*>& particles = system->getParticles();
-
     uint size = basis.size();
-    uint N    = particles.size();
 
-    MatrixXc T;     T.resize(size,size);
-    MatrixXc V;     V.resize(size,size);
+    MatrixXr T;     T.resize(size,size);
+    MatrixXr V;     V.resize(size,size);
     MatrixXr O;     O.resize(size,size);
 
-    for (uint m=0; m<size; ++m) {
-        for (uint n=0; n<=m; ++n) {
-            T(m,n) = 0;
-            V(m,n) = 0;
-            O(m,n) = 0;
-
-            auto              symFunc = symmetrize(basis[m]);
-            Basis&            A_sym   = std::get<0>(symFunc);
-            std::vector<int>& signs   = std::get<1>(symFunc);
-            uint              nperm   = std::get<2>(symFunc);
-
-            for (uint k=0; k<A_sym.size(); ++k) {
-                real ol = overlap(A_sym[k],basis[n]);
-
-                O(m,n) += signs[k]*nperm * ol;
-                T(m,n) += complex(signs[k]*nperm) * kinetic(A_sym[k],basis[n],ol);
-
-                for (uint i=0; i<N; ++ i) {
-                    for (uint j=0; j<i; ++j) {
-                        std::string p1 = particles[i]->name;
-                        std::string p2 = particles[j]->name;
-
-                        real c_ij = genc_ij(A_sym[k],basis[n],i,j);
-
-                        const InteractionV& inter = system->getInteraction(p1,p2);
-                        switch (inter.type) {
-                            case InteractionV::Gaussian:
-                                V(m,n) += complex(signs[k]*nperm)
-                                        * gaussianV(inter.v0,inter.r0,0,ol,c_ij);
-                                break;
-
-                            case InteractionV::Harmonic:
-                                break;
-                            case InteractionV::None:
-                                break;
-                        }
-                    }
-                }
-            }
-            O(n,m) = O(m,n);
-            T(n,m) = T(m,n);
-            V(n,m) = V(m,n);
-        }
-    }
+    assemble(basis,T,V,O,threads);
+
+    MatrixXr L  = O.llt().matrixL();
+    MatrixXr Hs = reduce(T+V,L);
 
-    return computeHermition(T,V,O);
+    if (useDavidson(size)) {
+        return computeDavidson(T,V,O,L,Hs,SolverResults(),size);
+    }
+    return computeHermition(T,V,O,L,Hs);
 }
 
-SolverResults CpuSolver::solveRow(const Basis& basis, SolverResults& cache, uint row)
+SolverResults CpuSolver::solveRow(const Basis& basis, const SolverResults& cache, uint row, uint threads)
 {
-    const std::vector<Particle*>& particles = system->getParticles();
+    return solveRow(cache,computeRow(basis,row,threads),row);
+}
 
-    uint N    = particles.size();
-    uint size = basis.size();
+SolverResults CpuSolver::solveRow(const SolverResults& cache, const SolverRow& r, uint row)
+{
+    uint size = r.O.rows();
 
 #ifdef DEBUG_BUILD
-    assert(cache.H.rows() == size ||
-           cache.H.rows() == size -1);
+    assert(cache.O.rows() == size ||
+           cache.O.rows() == size -1);
     assert(row < size);
 
-    if (cache.H.rows() == size-1) {
+    if (cache.O.rows() == size-1) {
         assert(row+1 == size);
     }
 #endif
 
-    MatrixXc T = cache.T;
-    MatrixXc V = cache.V;
+    MatrixXr T = cache.T;
+    MatrixXr V = cache.V;
     MatrixXr O = cache.O;
     T.conservativeResize(size,size);
     V.conservativeResize(size,size);
     O.conservativeResize(size,size);
 
-    uint n = row;
-    for (uint m=0; m<size; ++m) {
-        T(m,n) = 0;
-        V(m,n) = 0;
-        O(m,n) = 0;
-
-        auto              symFunc = symmetrize(basis[m]);
-        Basis&            A_sym   = std::get<0>(symFunc);
-        std::vector<int>& signs   = std::get<1>(symFunc);
-        uint              nperm   = std::get<2>(symFunc);
-
-        for (uint k=0; k<A_sym.size(); ++k) {
-            real ol = overlap(A_sym[k],basis[n]);
-
-            O(m,n) += signs[k]*nperm * ol;
-            T(m,n) += complex(signs[k]*nperm) * kinetic(A_sym[k],basis[n],ol);
-
-            for (uint i=0; i<N; ++ i) {
-                for (uint j=0; j<i; ++j) {
-                    std::string p1 = particles[i]->name;
-                    std::string p2 = particles[j]->name;
-
-                    real c_ij = genc_ij(A_sym[k],basis[n],i,j);
-
-                    const InteractionV& inter = system->getInteraction(p1,p2);
-                    switch (inter.type) {
-                        case InteractionV::Gaussian:
-                            V(m,n) += complex(signs[k]*nperm)
-                                    * gaussianV(inter.v0,inter.r0,0,ol,c_ij);
-                            break;
-
-                        case InteractionV::Harmonic:
-                            break;
-                        case InteractionV::None:
-                            break;
-                    }
-                }
-            }
-        }
+    T.col(row) = r.T;   T.row(row) = r.T.transpose();
+    V.col(row) = r.V;   V.row(row) = r.V.transpose();
+    O.col(row) = r.O;   O.row(row) = r.O.transpose();
+
+    //Appending only adds a row to the Cholesky factor and the reduced
+    //Hamiltonian. A NaN l_nn for a dependent function gives NaN eigenvalues.
+    MatrixXr L, Hs;
+    if (row+1 == size && cache.L.rows()+1 == size && cache.Hs.rows()+1 == size) {
+        L  = extendCholesky(cache.L,r.O);
+        Hs = extendReduced(cache.L,cache.Hs,L,r.T+r.V);
+    } else {
+        //An indefinite O means a dependent function, made NaN like above
+        Eigen::LLT<MatrixXr> llt(O);
+        L  = llt.matrixL();
+        if (llt.info() != Eigen::Success) L.setConstant(NAN);
+        Hs = reduce(T+V,L);
+    }
 
-        O(n,m) = O(m,n);
-        T(n,m) = T(m,n);
-        V(n,m) = V(m,n);
+    if (useDavidson(size)) {
+        return computeDavidson(T,V,O,L,Hs,cache,row);
     }
+    return computeHermition(T,V,O,L,Hs);
+}
+
+SolverResults CpuSolver::solveRows(const SolverResults& cache, const std::vector<SolverRow>& rows)
+{
+    uint n    = cache.O.rows();
+    uint size = n + rows.size();
 
-    return computeHermition(T,V,O);
+    MatrixXr T = cache.T;
+    MatrixXr V = cache.V;
+    MatrixXr O = cache.O;
+    T.conservativeResize(size,size);
+    V.conservativeResize(size,size);
+    O.conservativeResize(size,size);
+
+    for (uint j=0; j<rows.size(); ++j) {
+        const SolverRow& r = rows[j];
+        uint row = n+j;
+
+#ifdef DEBUG_BUILD
+        assert(r.O.rows() == row+1);
+#endif
+
+        T.col(row).head(row+1) = r.T;   T.row(row).head(row+1) = r.T.transpose();
+        V.col(row).head(row+1) = r.V;   V.row(row).head(row+1) = r.V.transpose();
+        O.col(row).head(row+1) = r.O;   O.row(row).head(row+1) = r.O.transpose();
+    }
+
+    //The block border goes into L and Hs a row at a time, O(n^2) each
+    MatrixXr L, Hs;
+    if (cache.L.rows() == n && cache.Hs.rows() == n) {
+        L  = cache.L;
+        Hs = cache.Hs;
+        for (uint j=0; j<rows.size(); ++j) {
+            MatrixXr Lnew = extendCholesky(L,rows[j].O);
+            Hs = extendReduced(L,Hs,Lnew,rows[j].T+rows[j].V);
+            L  = std::move(Lnew);
+        }
+    } else {
+        Eigen::LLT<MatrixXr> llt(O);
+        L  = llt.matrixL();
+        if (llt.info() != Eigen::Success) L.setConstant(NAN);
+        Hs = reduce(T+V,L);
+    }
+
+    if (useDavidson(size)) {
+        return computeDavidson(T,V,O,L,Hs,cache,n);
+    }
+    return computeHermition(T,V,O,L,Hs);
 }
 
-SolverResults CpuSolver::solveRot(const Basis& basis, real theta, SolverResults& unrot)
+SolverRow CpuSolver::computeRow(const Basis& basis, uint row, uint threads)
 {
-    const std::vector<Particle*>& particles = system->getParticles();
+    uint size = basis.size();
+
+    SolverRow r;
+    r.T.resize(size);
+    r.V.resize(size);
+    r.O.resize(size);
+
+    fillRow(basis,basis[row],r,threads);
 
+    return r;
+}
+
+SolverRow CpuSolver::computeRow(const Basis& basis, const CGaussian& trial, uint threads)
+{
     uint size = basis.size();
-    uint N    = particles.size();
 
-    MatrixXr O = unrot.O;
-    MatrixXc T = std::exp(complex(0,-2)*theta) * unrot.T;
-    MatrixXc V;
-    V.resize(size,size);
+    SolverRow r;
+    r.T.resize(size+1);
+    r.V.resize(size+1);
+    r.O.resize(size+1);
 
-    for (uint m=0; m<size; ++m) {
-        for (uint n=0; n<=m; ++n) {
-            V(m,n) = 0;
-
-            auto              symFunc = symmetrize(basis[m]);
-            Basis&            A_sym   = std::get<0>(symFunc);
-            std::vector<int>& signs   = std::get<1>(symFunc);
-            uint              nperm   = std::get<2>(symFunc);
-
-            for (uint k=0; k<A_sym.size(); ++k) {
-                real ol = overlap(A_sym[k],basis[n]);
-
-                for (uint i=0; i<N; ++ i) {
-                    for (uint j=0; j<i; ++j) {
-                        std::string& p1 = particles[i]->name;
-                        std::string& p2 = particles[j]->name;
-
-                        real c_ij = genc_ij(A_sym[k],basis[n],i,j);
-
-                        const InteractionV& inter = system->getInteraction(p1,p2);
-                        switch (inter.type) {
-                            case InteractionV::Gaussian:
-                                V(m,n) += complex(signs[k]*nperm)
-                                        * gaussianV(inter.v0,inter.r0,theta,ol,c_ij);
-                                break;
-
-                            case InteractionV::Harmonic:
-                                break;
-                            case InteractionV::None:
-                                break;
-                        }
-                    }
-                }
-            }
-            V(n,m) = V(m,n);
+    fillRow(basis,trial,r,threads);
+    element(trial,trial,r.T(size),r.V(size),r.O(size));
+
+    return r;
+}
+
+SolverRow CpuSolver::computeRow(const Basis& basis, const CGaussian& trial, SolverRowGradient& grad,
+                                uint threads)
+{
+    constexpr uint chunkSize = 16;
+
+    uint size    = basis.size();
+    uint nchunks = (size+chunkSize-1)/chunkSize;
+    uint N       = trial.widths.rows();
+    uint params  = N*(N-1)/2;
+
+    SolverRow r;
+    r.T.resize(size+1);
+    r.V.resize(size+1);
+    r.O.resize(size+1);
+    grad.T.resize(params,size+1);
+    grad.V.resize(params,size+1);
+    grad.O.resize(params,size+1);
+
+    parallelFor(nchunks,threads,[&](uint k) {
+        uint mstart = k*chunkSize;
+        uint mend   = std::min(mstart+chunkSize,size);
+
+        for (uint m=mstart; m<mend; ++m) {
+            elementGradient(basis[m],trial,r.T(m),r.V(m),r.O(m),
+                            grad.T.col(m).data(),grad.V.col(m).data(),grad.O.col(m).data());
+        }
+    });
+
+    elementGradient(trial,trial,r.T(size),r.V(size),r.O(size),
+                    grad.T.col(size).data(),grad.V.col(size).data(),grad.O.col(size).data());
+
+    //The trial is on both sides of its own element, and <PB|H|dB> = <dB|H|PB>
+    //for the symmetrizer P, so only one side needs differentiating
+    grad.T.col(size) *= 2;
+    grad.V.col(size) *= 2;
+    grad.O.col(size) *= 2;
+
+    return r;
+}
+
+void CpuSolver::fillRow(const Basis& basis, const CGaussian& cg, SolverRow& r, uint threads)
+{
+    constexpr uint chunkSize = 16;
+
+    uint size    = basis.size();
+    uint nchunks = (size+chunkSize-1)/chunkSize;
+
+    parallelFor(nchunks,threads,[&](uint k) {
+        uint mstart = k*chunkSize;
+        uint mend   = std::min(mstart+chunkSize,size);
+
+        for (uint m=mstart; m<mend; ++m) {
+            element(basis[m],cg,r.T(m),r.V(m),r.O(m));
         }
+    });
+}
+
+SolverResults CpuSolver::removeRow(const SolverResults& cache, uint row)
+{
+    uint n = cache.O.rows();
+
+#ifdef DEBUG_BUILD
+    assert(row < n);
+#endif
+
+    if (n == 1) {
+        return SolverResults();
+    }
+
+    //Every block of M but the row and column of the removed function
+    uint m = n-row-1;
+    auto drop = [row,m](const MatrixXr& M) {
+        MatrixXr out(row+m,row+m);
+        out.topLeftCorner(row,row)  = M.topLeftCorner(row,row);
+        out.topRightCorner(row,m)   = M.topRightCorner(row,m);
+        out.bottomLeftCorner(m,row) = M.bottomLeftCorner(m,row);
+        out.bottomRightCorner(m,m)  = M.bottomRightCorner(m,m);
+        return out;
+    };
+
+    MatrixXr T = drop(cache.T);
+    MatrixXr V = drop(cache.V);
+    MatrixXr O = drop(cache.O);
+
+    MatrixXr L;
+    if ((uint)cache.L.rows() == n) {
+        L = removeCholesky(cache.L,row);
+    } else {
+        Eigen::LLT<MatrixXr> llt(O);
+        L = llt.matrixL();
+        if (llt.info() != Eigen::Success) L.setConstant(NAN);
     }
+    MatrixXr Hs = reduce(T+V,L);
 
-    return computeQZ(T,V,O);
+    return computeHermition(T,V,O,L,Hs);
 }
 
-SolverResults CpuSolver::solveRotRow(const Basis& basis, real theta, SolverResults& cache, uint row)
+real CpuSolver::orthogonality(const SolverResults& cache, const SolverRow& r)
 {
-    const std::vector<Particle*>& particles = system->getParticles();
+    uint n = cache.L.rows();
 
-    uint N    = particles.size();
-    uint size = basis.size();
+    VectorXr y = r.O.head(n);
+    cache.L.triangularView<Eigen::Lower>().solveInPlace(y);
 
-    MatrixXc T = cache.T;
-    MatrixXc V = cache.V;
-    MatrixXr O = cache.O;
-    T.conservativeResize(size,size);
-    V.conservativeResize(size,size);
-    O.conservativeResize(size,size);
+    return (r.O(n) - y.squaredNorm()) / r.O(n);
+}
 
-    uint n = row;
-    for (uint m=0; m<size; ++m) {
-        T(m,n) = 0;
-        V(m,n) = 0;
-        O(m,n) = 0;
-
-        auto              symFunc = symmetrize(basis[m]);
-        Basis&            A_sym   = std::get<0>(symFunc);
-        std::vector<int>& signs   = std::get<1>(symFunc);
-        uint              nperm   = std::get<2>(symFunc);
-
-        for (uint k=0; k<A_sym.size(); ++k) {
-            real ol = overlap(A_sym[k],basis[n]);
-
-            O(m,n) += signs[k]*nperm * ol;
-            T(m,n) += complex(signs[k]*nperm) * kinetic(A_sym[k],basis[n],ol);
-
-            for (uint i=0; i<N; ++ i) {
-                for (uint j=0; j<i; ++j) {
-                    std::string p1 = particles[i]->name;
-                    std::string p2 = particles[j]->name;
-
-                    real c_ij = genc_ij(A_sym[k],basis[n],i,j);
-
-                    const InteractionV& inter = system->getInteraction(p1,p2);
-                    switch (inter.type) {
-                        case InteractionV::Gaussian:
-                            V(m,n) += complex(signs[k]*nperm)
-                                    * gaussianV(inter.v0,inter.r0,theta,ol,c_ij);
-                            break;
-
-                        case InteractionV::Harmonic:
-                            break;
-                        case InteractionV::None:
-                            break;
-                    }
-                }
-            }
+complex CpuSolver::screenRow(const SolverResults& cache, const SolverRow& r, uint target)
+{
+    return screen(cache,r,target,nullptr,nullptr);
+}
+
+complex CpuSolver::screenRow(const SolverResults& cache, const SolverRow& r, uint target,
+                             const SolverRowGradient& grad, VectorXr& gradient)
+{
+    return screen(cache,r,target,&grad,&gradient);
+}
+
+complex CpuSolver::screen(const SolverResults& cache, const SolverRow& r, uint target,
+                          const SolverRowGradient* grad, VectorXr* gradient)
+{
+    //With O-normalized eigenvectors x_k of the basis, the new function's
+    //component orthogonal to the basis gives the bordered matrix
+    //  [ diag(lambda)  b ]
+    //  [ b^T           d ]
+    //whose eigenvalues are the roots of f(E) = d - E - sum b_k^2/(lambda_k - E).
+    //With only the lowest eigenpairs from the iterative solver this is the
+    //Rayleigh-Ritz estimate in their span and the new function, an upper bound.
+    uint n  = cache.eigenvalues.size();
+    uint nb = r.O.rows()-1;
+
+#ifdef DEBUG_BUILD
+    assert(cache.O.rows() == nb);
+#endif
+
+    VectorXr h = r.T+r.V;
+    const VectorXr& o = r.O;
+
+    VectorXr lambda(n), g(n), c(n);
+    for (uint k=0; k<n; ++k) {
+        const VectorXr& x = cache.eigenvectors[k];
+        lambda(k) = cache.eigenvalues[k].real();
+        g(k) = x.dot(h.head(nb));
+        c(k) = x.dot(o.head(nb));
+    }
+
+    real s = o(nb) - c.squaredNorm();
+    if (!(s > 0)) return complex(NAN,0);
+
+    VectorXr b  = (g - lambda.cwiseProduct(c)) / std::sqrt(s);
+    VectorXr b2 = b.cwiseProduct(b);
+    real     d  = (h(nb) - 2*c.dot(g) + c.cwiseProduct(c).dot(lambda)) / s;
+
+    if (target > n) target = n;
+
+    real E = d;
+    if (n > 0) {
+        //f is decreasing between its poles and the target root is bracketed by
+        //lambda_(target-1) and lambda_target, the outer ones by the Gershgorin bounds
+        real lo = (target == 0) ? std::min(lambda(0),d) - b.lpNorm<1>() : lambda(target-1);
+        real hi = (target == n) ? std::max(lambda(n-1),d) + b.lpNorm<1>() : lambda(target);
+
+        for (uint it=0; it<200 && hi-lo > 4*std::numeric_limits<real>::epsilon()*std::abs(hi); ++it) {
+            real mid = (lo+hi)/2;
+            real f = d - mid - (b2.array() / (lambda.array() - mid)).sum();
+
+            if (f > 0) lo = mid;
+            else       hi = mid;
+        }
+        E = (lo+hi)/2;
+    }
+
+    if (grad) {
+        //The bordered eigenvector is z = (b_k/(E-lambda_k), 1), in the basis
+        //functions and the new one x = X(z_k - c_k/sqrt(s)) + e_new/sqrt(s).
+        //Only the new row of H and O depends on the parameters, so
+        //dE = x^T (dH - E dO) x / z^T z with
+        //x^T dH x = 2 x_new x_old.dh + x_new^2 dh_new.
+        VectorXr z(n);
+        for (uint k=0; k<n; ++k) {
+            z(k) = (b(k) == 0) ? 0 : b(k)/(E - lambda(k));
+        }
+
+        VectorXr xold = VectorXr::Zero(nb);
+        for (uint k=0; k<n; ++k) {
+            xold += (z(k) - c(k)/std::sqrt(s)) * cache.eigenvectors[k];
         }
-        T(m,n) *= std::exp(complex(0,-2*theta));
+        real xnew = 1/std::sqrt(s);
+
+        MatrixXr D = grad->T + grad->V - E*grad->O;
+        *gradient  = (2*xnew*(D.leftCols(nb)*xold) + xnew*xnew*D.col(nb)) / (1 + z.squaredNorm());
+    }
+
+    return complex(E,0);
+}
+
+SolverResults CpuSolver::solveRot(const Basis& basis, real theta, SolverResults& unrot, uint threads)
+{
+    uint size = basis.size();
+
+#ifdef DEBUG_BUILD
+    assert(!rotCached || rotFuncs.size() == size);
+#endif
+
+    SolverResults out;
+    out.T = unrot.T;
+    out.V = unrot.V;
+    out.O = unrot.O;
+    out.L = (unrot.L.rows() == size) ? unrot.L : MatrixXr(unrot.O.llt().matrixL());
+    out.Vrot = rotatedVMatrix(basis,theta,false,threads);
+
+    MatrixXc H = std::exp(complex(0,-2*theta))*out.T + out.Vrot;
+    out.eigenvalues = computeRotated(H, out.O, out.L, threads);
 
-        O(n,m) = O(m,n);
-        T(n,m) = T(m,n);
-        V(n,m) = V(m,n);
+    if (rotVectors) {
+        selectVectors(out,theta);
     }
 
-    return computeQZ(T,V,O);
+    return out;
 }
 
-SolverResults CpuSolver::computeHermition(MatrixXc& T, MatrixXc& V, MatrixXr& O)
+SolverResults CpuSolver::solveRotRow(const Basis& basis, real theta, SolverResults& cache, uint row, uint threads)
 {
-    MatrixXc H = T+V;
+    uint size = basis.size();
+
+#ifdef DEBUG_BUILD
+    assert(!rotCached || rotFuncs.size() == size);
+#endif
+
+    SolverResults out;
+    out.T    = cache.T;
+    out.Vrot = cache.Vrot;
+    out.O    = cache.O;
+    out.T.conservativeResize(size,size);
+    out.Vrot.conservativeResize(size,size);
+    out.O.conservativeResize(size,size);
+
+    parallelFor(size,threads,[&](uint m) {
+        real T, O;
+        out.Vrot(m,row) = out.Vrot(row,m) = rotatedElement(basis,std::max(m,row),std::min(m,row),
+                                                           theta,false,T,O);
+        out.T(m,row)    = out.T(row,m)    = T;
+        out.O(m,row)    = out.O(row,m)    = O;
+    });
+
+    if (row+1 == size && cache.L.rows()+1 == size) {
+        out.L = extendCholesky(cache.L,out.O.col(row));
+    } else {
+        out.L = out.O.llt().matrixL();
+    }
+
+    MatrixXc H = std::exp(complex(0,-2*theta))*out.T + out.Vrot;
+    out.eigenvalues = computeRotated(H, out.O, out.L, threads);
+
+    if (rotVectors) {
+        selectVectors(out,theta);
+    }
+
+    return out;
+}
 
-    Eigen::GeneralizedSelfAdjointEigenSolver<MatrixXc> eigenSolver;
-    eigenSolver.compute(H,O.cast<complex>());
+SolverResults CpuSolver::solveRotRows(const Basis& basis, real theta, SolverResults& cache, uint first, uint threads)
+{
+    uint size = basis.size();
 
-    VectorXc  eigenvals = eigenSolver.eigenvalues().cast<complex>();
-    MatrixXc  eigenvecs = eigenSolver.eigenvectors();
+#ifdef DEBUG_BUILD
+    assert(!rotCached || rotFuncs.size() == size);
+    assert(first <= size && cache.O.rows() >= first);
+#endif
 
     SolverResults out;
-    out.O = O;
-    out.T = T;
-    out.V = V;
+    out.T    = cache.T;
+    out.Vrot = cache.Vrot;
+    out.O    = cache.O;
+    out.T.conservativeResize(size,size);
+    out.Vrot.conservativeResize(size,size);
+    out.O.conservativeResize(size,size);
+
+    //Element (m,n) of a new row m, unless n is a later new row that fills it
+    uint rows = size-first;
+    parallelFor(rows*size,threads,[&](uint i) {
+        uint m = first + i/size;
+        uint n = i%size;
+        if (n > m) return;
+
+        real T, O;
+        out.Vrot(m,n) = out.Vrot(n,m) = rotatedElement(basis,m,n,theta,false,T,O);
+        out.T(m,n)    = out.T(n,m)    = T;
+        out.O(m,n)    = out.O(n,m)    = O;
+    });
+
+    if (cache.L.rows() == first) {
+        out.L = cache.L;
+        for (uint m=first; m<size; ++m) {
+            out.L = extendCholesky(out.L,out.O.col(m).head(m+1));
+        }
+    } else {
+        Eigen::LLT<MatrixXr> llt(out.O);
+        out.L = llt.matrixL();
+        if (llt.info() != Eigen::Success) out.L.setConstant(NAN);
+    }
+
+    MatrixXc H = std::exp(complex(0,-2*theta))*out.T + out.Vrot;
+    out.eigenvalues = computeRotated(H, out.O, out.L, threads);
 
-    std::vector<std::pair<complex,int>> sortvec;
-    for (uint k=0; k<eigenvals.rows(); ++k) {
-        sortvec.push_back( std::make_pair(eigenvals(k),k) );
+    if (rotVectors) {
+        selectVectors(out,theta);
     }
 
-    struct {
-        bool operator()(std::pair<complex,int> a, std::pair<complex,int> b) {
-            return a.first.real() < b.first.real();
+    return out;
+}
+
+void CpuSolver::prepareRot(const Basis& basis, uint threads)
+{
+    uint size = basis.size();
+
+    //T, O and termCount prefactors and c_ij per element
+    size_t elements = packed(size,0);
+    real   megabytes = elements*(2+2*termCount)*sizeof(real) / (1024.*1024.);
+
+    if (!(megabytes <= rotCacheMB)) {
+        std::vector<real>().swap(rotT);
+        std::vector<real>().swap(rotO);
+        std::vector<real>().swap(rotPre);
+        std::vector<real>().swap(rotC);
+        rotFuncs.clear();
+        rotCached = false;
+        return;
+    }
+    rotCached = true;
+
+    //A row is stale if its function changed since the cache was built
+    std::vector<bool> stale(size);
+    for (uint m=0; m<size; ++m) {
+        stale[m] = m >= rotFuncs.size() || rotFuncs[m] != basis[m].sym;
+    }
+
+    rotFuncs.resize(size);
+    for (uint m=0; m<size; ++m) {
+        rotFuncs[m] = basis[m].sym;
+    }
+
+    rotT.resize(elements);
+    rotO.resize(elements);
+    rotPre.resize(elements*termCount);
+    rotC.resize(elements*termCount);
+
+    parallelFor(size,threads,[&](uint k) {
+        uint m = size-1-k;
+        for (uint n=0; n<=m; ++n) {
+            if (!stale[m] && !stale[n]) continue;
+
+            size_t e = packed(m,n);
+            cacheElement(basis[m],basis[n],rotT[e],rotO[e],&rotPre[e*termCount],&rotC[e*termCount]);
         }
-    } customLess;
-    std::sort(sortvec.begin(),sortvec.end(),customLess);
+    });
+}
+
+SolverResults CpuSolver::computeHermition(MatrixXr& T, MatrixXr& V, MatrixXr& O, MatrixXr& L, MatrixXr& Hs)
+{
+    //Hs y = E y, with eigenvectors x = L^-T y normalized as x^T O x = 1.
+    //Eigenvalues come out sorted in increasing order
+    Eigen::SelfAdjointEigenSolver<MatrixXr> eigenSolver(Hs);
+
+    const VectorXr& eigenvals = eigenSolver.eigenvalues();
+    MatrixXr        eigenvecs = eigenSolver.eigenvectors();
+    L.triangularView<Eigen::Lower>().transpose().solveInPlace(eigenvecs);
+
+    SolverResults out;
+    out.O  = O;
+    out.T  = T;
+    out.V  = V;
+    out.L  = L;
+    out.Hs = Hs;
 
     out.eigenvalues.resize(eigenvals.rows());
     out.eigenvectors.resize(eigenvals.rows());
     for (int k=0; k<eigenvals.rows(); ++k) {
-        out.eigenvalues[k]  = sortvec[k].first;
-        out.eigenvectors[k] = eigenvecs.col( sortvec[k].second );
+        out.eigenvalues[k]  = complex(eigenvals(k),0);
+        out.eigenvectors[k] = eigenvecs.col(k);
     }
 
     return out;
 }
 
-SolverResults CpuSolver::computeQZ(MatrixXc& T, MatrixXc& V, MatrixXr& O)
+bool CpuSolver::useDavidson(uint size) const
 {
-    MatrixXc H = T+V;
+    //Small bases, or ones where most of the spectrum is wanted anyway, are
+    //cheaper to diagonalize densely
+    return iterative && numStates > 0 && size > 4*numStates + 32;
+}
 
-    int n     = H.rows();
-    int ldvl  = n;
-    int ldvr  = n;
-    int lwork = 2*n;
-    int info;
+SolverResults CpuSolver::computeDavidson(MatrixXr& T, MatrixXr& V, MatrixXr& O, MatrixXr& L, MatrixXr& Hs,
+                                         const SolverResults& guess, uint row)
+{
+    constexpr real tolerance = 1e-9;
+    constexpr uint maxIter   = 500;
 
-    fortranComplex16* A     = new fortranComplex16[n*n];
-    fortranComplex16* B     = new fortranComplex16[n*n];
-    fortranComplex16* alpha = new fortranComplex16[n];
-    fortranComplex16* beta  = new fortranComplex16[n];
-    fortranComplex16* work  = new fortranComplex16[std::max(1,lwork)];
-    double*           rwork = new double[8*n];
+    uint n      = O.rows();
+    uint k      = std::min(numStates,n);
+    uint maxDim = std::min(n, std::max(4*k,k+24));
 
-    for (int i=0; i<n; ++i) {
-        for (int j=0; j<n; ++j) {
-            A[n*i+j].real = H.data()[n*i+j].real();
-            A[n*i+j].imag = H.data()[n*i+j].imag();
-            B[n*i+j].real = O.data()[n*i+j];
-            B[n*i+j].imag = 0;
-        }
+    SolverResults out;
+    out.O  = O;
+    out.T  = T;
+    out.V  = V;
+    out.L  = L;
+    out.Hs = Hs;
+
+    //Dependent functions give NaN energies like the dense solve does
+    if (!L.diagonal().allFinite()) {
+        out.eigenvalues.assign(k,complex(NAN,0));
+        out.eigenvectors.assign(k,VectorXr::Zero(n));
+        return out;
     }
 
-    zggev_("N","N",&n,A,&n,B,&n,alpha,beta,nullptr,&ldvl,nullptr,&ldvr,work,&lwork,rwork,&info);
+    VectorXr diag = Hs.diagonal();
 
-    std::vector<complex> eigenvalues;
-    for (int i=0; i<n; ++i) {
-        eigenvalues.push_back(complex(alpha[i].real,alpha[i].imag)
-                             /complex(beta[i].real,beta[i].imag));
+    //Orthonormal search space S with Hs S kept alongside
+    MatrixXr S(n,maxDim), HS(n,maxDim);
+    uint m = 0;
+
+    //Orthogonalizes t against S twice and appends it unless it was
+    //(nearly) in the span already
+    auto expand = [&](VectorXr t) {
+        if (m == maxDim) return false;
+
+        real norm0 = t.norm();
+        if (!(norm0 > 0)) return false;
+
+        for (int pass=0; pass<2 && m>0; ++pass) {
+            t -= S.leftCols(m) * (S.leftCols(m).transpose()*t);
+        }
+
+        real norm = t.norm();
+        if (!(norm > 1e-8*norm0)) return false;
+
+        S.col(m)  = t/norm;
+        HS.col(m) = Hs.selfadjointView<Eigen::Lower>()*S.col(m);
+        ++m;
+        return true;
+    };
+
+    //Warm start from the previous eigenvectors, y = L^T x, and the changed
+    //function. The leading block of L is unchanged when a function is appended
+    //and the eigenvectors of the old basis padded with zeros are good guesses.
+    for (uint i=0; i<guess.eigenvectors.size() && i<k; ++i) {
+        uint len = std::min<uint>(guess.L.rows(),n);
+
+        VectorXr t = VectorXr::Zero(n);
+        t.head(len) = guess.L.topLeftCorner(len,len).triangularView<Eigen::Lower>().transpose()
+                    * guess.eigenvectors[i].head(len);
+        if (row < len) t(row) = 0;
+        expand(t);
+    }
+    if (row < n) {
+        expand(VectorXr::Unit(n,row));
+    }
+    if (m < k) {
+        std::vector<uint> order(n);
+        for (uint i=0; i<n; ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](uint a, uint b) {
+            return diag(a) < diag(b);
+        });
+        for (uint i=0; i<n && m<std::min(maxDim,2*k); ++i) {
+            expand(VectorXr::Unit(n,order[i]));
+        }
     }
 
-    struct {
-        bool operator()(complex a, complex b) {
-            return a.real() < b.real();
+    VectorXr lambda;
+    MatrixXr Y;
+    bool     converged = false;
+    for (uint iter=0; iter<maxIter; ++iter) {
+        //Rayleigh-Ritz in the search space
+        MatrixXr A = S.leftCols(m).transpose()*HS.leftCols(m);
+        Eigen::SelfAdjointEigenSolver<MatrixXr> ritz(A);
+
+        uint kk = std::min(k,m);
+        lambda = ritz.eigenvalues().head(kk);
+        MatrixXr C  = ritz.eigenvectors().leftCols(kk);
+        Y           = S.leftCols(m)*C;
+        MatrixXr HY = HS.leftCols(m)*C;
+
+        MatrixXr R = HY - Y*lambda.asDiagonal();
+
+        std::vector<uint> open;
+        for (uint i=0; i<kk; ++i) {
+            if (R.col(i).norm() > tolerance*std::max<real>(1,std::abs(lambda(i)))) {
+                open.push_back(i);
+            }
+        }
+        if (open.empty() && kk == k) {
+            converged = true;
+            break;
         }
-    } customLess;
-    std::sort(eigenvalues.begin(),eigenvalues.end(),customLess);
 
-    delete[] rwork;
-    delete[] work;
-    delete[] beta;
-    delete[] alpha;
-    delete[] B;
-    delete[] A;
+        //Restart from the Ritz vectors when the new directions do not fit
+        if (m + open.size() > maxDim) {
+            S.leftCols(kk)  = Y;
+            HS.leftCols(kk) = HY;
+            m = kk;
+        }
+
+        //Davidson correction with the diagonal preconditioner (Hs_ii - lambda)^-1
+        uint added = 0;
+        for (uint i : open) {
+            VectorXr denom = diag.array() - lambda(i);
+            for (uint j=0; j<n; ++j) {
+                if (std::abs(denom(j)) < 1e-8) denom(j) = (denom(j) < 0) ? -1e-8 : 1e-8;
+            }
+            added += expand(R.col(i).cwiseQuotient(denom));
+        }
+        if (added == 0) break;
+    }
+
+    //Stagnated or out of iterations, the Ritz pairs would pass for
+    //eigenpairs that are not
+    if (!converged) {
+        return computeHermition(T,V,O,L,Hs);
+    }
+
+    L.triangularView<Eigen::Lower>().transpose().solveInPlace(Y);
+
+    out.eigenvalues.resize(lambda.rows());
+    out.eigenvectors.resize(lambda.rows());
+    for (int i=0; i<lambda.rows(); ++i) {
+        out.eigenvalues[i]  = complex(lambda(i),0);
+        out.eigenvectors[i] = Y.col(i);
+    }
+
+    return out;
+}
+
+SolverResults CpuSolver::continueRot(const Basis& basis, real theta, const SolverResults& prev,
+                                     real prevTheta, uint threads)
+{
+    constexpr uint maxFactor = 3;
+    constexpr uint maxIter   = 20;
+
+#ifdef DEBUG_BUILD
+    uint size = basis.size();
+    assert(!rotCached || rotFuncs.size() == size);
+    assert(prev.O.rows() == size);
+#endif
 
     SolverResults out;
-    out.O = O;
-    out.T = T;
-    out.V = V;
-    out.eigenvalues = eigenvalues;
+    out.T    = prev.T;
+    out.V    = prev.V;
+    out.O    = prev.O;
+    out.L    = prev.L;
+    out.Vrot = rotatedVMatrix(basis,theta,false,threads);
+
+    //dH/dtheta = -2i e^(-2i theta) T + dV/dtheta at the previous angle
+    MatrixXc dH = complex(0,-2)*std::exp(complex(0,-2*prevTheta))*prev.T
+                + rotatedVMatrix(basis,prevTheta,true,threads);
+
+    MatrixXc H  = std::exp(complex(0,-2*theta))*out.T + out.Vrot;
+    MatrixXc Oc = out.O.cast<complex>();
+
+    uint tracked = prev.selected.size();
+    out.eigenvalues.resize(tracked);
+    out.rotEigenvectors.resize(tracked);
+    out.selected.resize(tracked);
+
+    parallelFor(tracked,threads,[&](uint k) {
+        //With x^T O x = 1 the left and right eigenvectors coincide, dE = x^T dH x dtheta
+        VectorXc x  = prev.rotEigenvectors[k];
+        complex  E  = prev.eigenvalues[prev.selected[k]]
+                    + (theta-prevTheta)*x.cwiseProduct(dH*x).sum();
+        VectorXc Ox = Oc*x;
+
+        //Inverse iterations from one factorization, moving E to the Rayleigh
+        //quotient, and a new factorization at the current E if that stalls
+        bool converged = false;
+        for (uint f=0; f<maxFactor && !converged; ++f) {
+            Eigen::PartialPivLU<MatrixXc> lu(H - E*Oc);
+
+            for (uint it=0; it<maxIter; ++it) {
+                VectorXc y  = lu.solve(Ox);
+                VectorXc Oy = Oc*y;
+
+                complex norm = std::sqrt(y.cwiseProduct(Oy).sum());
+                y  /= norm;
+                Oy /= norm;
+                if (std::real(y.cwiseProduct(Ox).sum()) < 0) {
+                    y  = -y;
+                    Oy = -Oy;
+                }
+
+                complex Enew = y.cwiseProduct(H*y).sum();
+                converged = std::abs(Enew-E) <= 1e-12*(1+std::abs(E));
+
+                x  = y;
+                Ox = Oy;
+                E  = Enew;
+                if (converged) break;
+            }
+        }
+
+        out.eigenvalues[k]     = E;
+        out.rotEigenvectors[k] = x;
+        out.selected[k]        = k;
+    });
 
     return out;
 }
 
-/*SolverResults CpuSolver::computeRF(MatrixXc& T, MatrixXc& V, MatrixXr& O,
-                                   const Basis& basis, SolverResults& uplft)
+VectorXc CpuSolver::rotEigenvector(const SolverResults& rot, real theta, complex E)
 {
-    real n = O.rows()-2; //the index of the last column before
-                         //new row was added;
+    constexpr uint maxIter = 8;
 
-    real norm = O(n+1,n+1);
-    for (int i=0; i<n; ++i) {
-        real a = 0;
-        for (int j=0; j<n; ++j) {
-            a += uplft.eigenvectors[i](j).real() * overlap(basis[j],basis[n+1]);
+    uint size = rot.O.rows();
+
+    MatrixXc H  = std::exp(complex(0,-2*theta))*rot.T + rot.Vrot;
+    MatrixXc Oc = rot.O.cast<complex>();
+
+    //Shifted just off E so the factorization stays regular, the iterates then
+    //grow by 1/|E - shift| along x in a single step or two
+    complex shift = E + complex(1,1)*(1e-12*(1+std::abs(E)));
+    Eigen::PartialPivLU<MatrixXc> lu(H - shift*Oc);
+
+    VectorXc x  = VectorXc::Ones(size) / std::sqrt((real)size);
+    VectorXc Ox = Oc*x;
+    for (uint it=0; it<maxIter; ++it) {
+        VectorXc y  = lu.solve(Ox);
+        VectorXc Oy = Oc*y;
+
+        complex norm = std::sqrt(y.cwiseProduct(Oy).sum());
+        y  /= norm;
+        Oy /= norm;
+
+        //The c-normalization leaves the sign free
+        if (std::real(y.cwiseProduct(Ox).sum()) < 0) {
+            y  = -y;
+            Oy = -Oy;
         }
-        norm -= std::abs(a) * std::abs(a);
+
+        bool converged = (y-x).norm() <= 1e-10*y.norm();
+        x  = y;
+        Ox = Oy;
+        if (converged) break;
+    }
+
+    return x;
+}
+
+void CpuSolver::selectVectors(SolverResults& rot, real theta)
+{
+    rot.selected.clear();
+    rot.rotEigenvectors.clear();
+
+    for (uint k=0; k<rot.eigenvalues.size(); ++k) {
+        if (vectorWindow.contains(rot.eigenvalues[k])) {
+            rot.selected.push_back(k);
+            rot.rotEigenvectors.push_back(rotEigenvector(rot,theta,rot.eigenvalues[k]));
+        }
+    }
+}
+
+std::vector<complex> CpuSolver::computeRotated(MatrixXc& H, const MatrixXr& O, const MatrixXr& L, uint threads)
+{
+    if (slicing) {
+        return computeSlices(H,O,threads);
+    }
+
+    if (complexSymmetric && L.diagonal().allFinite()) {
+        std::vector<complex> eigenvalues;
+        if (computeSymmetric(H,L,eigenvalues)) {
+            return eigenvalues;
+        }
+    }
+
+    return computeQZ(H,O);
+}
+
+std::vector<complex> CpuSolver::computeSlices(const MatrixXc& H, const MatrixXr& O, uint threads)
+{
+    constexpr uint maxDepth = 4;
+
+    MatrixXc Oc = O.cast<complex>();
+
+    std::vector<EnergyWindow> boxes;
+    real width = (sliceWindow.reMax - sliceWindow.reMin) / std::max(1u,slices);
+    for (uint k=0; k<std::max(1u,slices); ++k) {
+        EnergyWindow box = sliceWindow;
+        box.reMin = sliceWindow.reMin + k*width;
+        box.reMax = (k+1 == slices) ? sliceWindow.reMax : box.reMin + width;
+        boxes.push_back(box);
     }
 
-    std::cout << "N = \n" << norm << "\n\n ";
+    //Boxes are disjoint and each keeps only its own eigenvalues, so nothing
+    //is found twice. Incomplete boxes are quartered and solved again, the
+    //ones still incomplete at maxDepth are left to QZ.
+    std::vector<complex>      eigenvalues;
+    std::vector<EnergyWindow> unresolved;
+    for (uint depth=0; depth<=maxDepth && !boxes.empty(); ++depth) {
+        std::vector<std::vector<complex>> found(boxes.size());
+        std::vector<char> complete(boxes.size());
+
+        parallelFor(boxes.size(),threads,[&](uint b) {
+            complete[b] = sliceEigenvalues(H,Oc,boxes[b],found[b]);
+        });
+
+        std::vector<EnergyWindow> next;
+        for (uint b=0; b<boxes.size(); ++b) {
+            if (complete[b]) {
+                eigenvalues.insert(eigenvalues.end(),found[b].begin(),found[b].end());
+                continue;
+            }
+            if (depth == maxDepth) {
+                unresolved.push_back(boxes[b]);
+                continue;
+            }
 
-    return computeHermition(T,V,O);
-}*/
+            real reMid = (boxes[b].reMin + boxes[b].reMax)/2;
+            real imMid = (boxes[b].imMin + boxes[b].imMax)/2;
+            next.push_back({boxes[b].reMin, reMid, boxes[b].imMin, imMid});
+            next.push_back({reMid, boxes[b].reMax, boxes[b].imMin, imMid});
+            next.push_back({boxes[b].reMin, reMid, imMid, boxes[b].imMax});
+            next.push_back({reMid, boxes[b].reMax, imMid, boxes[b].imMax});
+        }
+        boxes = next;
+    }
+
+    if (!unresolved.empty()) {
+        MatrixXc Hq = H;
+        for (complex E : computeQZ(Hq,O)) {
+            for (auto& box : unresolved) {
+                if (box.contains(E)) {
+                    eigenvalues.push_back(E);
+                    break;
+                }
+            }
+        }
+    }
+
+    std::sort(eigenvalues.begin(),eigenvalues.end(),[](complex a, complex b) {
+        return a.real() < b.real();
+    });
+
+    return eigenvalues;
+}
+
+//Swaps the diagonal entries i and i+1 of the upper triangular T of a complex
+//Schur form A = Z T Z^*, the same rotation as LAPACK's ztrexc
+static void swapSchur(MatrixXc& T, MatrixXc& Z, uint i)
+{
+    uint    n = T.rows();
+    complex f = T(i,i+1);
+    complex g = T(i+1,i+1) - T(i,i);
+    if (g == complex(0,0)) return;
+
+    //c f + s g = r and c g - conj(s) f = 0
+    real    c = 0;
+    complex s = std::conj(g)/std::abs(g);
+    if (f != complex(0,0)) {
+        real norm = std::sqrt(std::norm(f) + std::norm(g));
+        c = std::abs(f)/norm;
+        s = f/std::abs(f) * std::conj(g)/norm;
+    }
+
+    for (uint j=i+2; j<n; ++j) {
+        complex x = T(i,j), y = T(i+1,j);
+        T(i,j)   = c*x + s*y;
+        T(i+1,j) = c*y - std::conj(s)*x;
+    }
+    for (uint r=0; r<i; ++r) {
+        complex x = T(r,i), y = T(r,i+1);
+        T(r,i)   = c*x + std::conj(s)*y;
+        T(r,i+1) = c*y - s*x;
+    }
+    for (uint r=0; r<n; ++r) {
+        complex x = Z(r,i), y = Z(r,i+1);
+        Z(r,i)   = c*x + std::conj(s)*y;
+        Z(r,i+1) = c*y - s*x;
+    }
+    std::swap(T(i,i),T(i+1,i+1));
+}
+
+bool CpuSolver::sliceEigenvalues(const MatrixXc& H, const MatrixXc& O, const EnergyWindow& box,
+                                 std::vector<complex>& found)
+{
+    constexpr uint krylov      = 60;
+    constexpr uint maxRestarts = 40;
+    constexpr real tolerance   = 1e-10;
+
+    uint n = H.rows();
+    uint m = std::min(n,krylov);
+    uint p = m/2; //Schur vectors kept on a restart
+
+    complex sigma(  (box.reMin+box.reMax)/2,   (box.imMin+box.imMax)/2);
+    real    radius = std::abs(complex(box.reMax-box.reMin, box.imMax-box.imMin))/2;
+
+    //Arnoldi on (H - sigma O)^-1 O, whose eigenvalues 1/(E - sigma) are
+    //largest for the E closest to the center of the box
+    Eigen::PartialPivLU<MatrixXc> lu(H - sigma*O);
+
+    MatrixXc Q(n,m+1);
+    MatrixXc Hm = MatrixXc::Zero(m+1,m);
+    Q.col(0) = VectorXc::Ones(n) / std::sqrt((real)n);
+
+    //Krylov-Schur: the p Ritz values of largest modulus are kept in a
+    //reordered Schur form and the space is grown back to m from there
+    uint start = 0;
+    for (uint restart=0; restart<=maxRestarts; ++restart) {
+        uint k = m;
+        bool invariant = false;
+        for (uint j=start; j<m; ++j) {
+            VectorXc w = lu.solve(O*Q.col(j));
+            real norm0 = w.norm();
+
+            for (int pass=0; pass<2; ++pass) {
+                VectorXc h = Q.leftCols(j+1).adjoint()*w;
+                w -= Q.leftCols(j+1)*h;
+                Hm.col(j).head(j+1) += h;
+            }
+
+            Hm(j+1,j) = w.norm();
+            if (std::abs(Hm(j+1,j)) <= 1e-14*norm0) {
+                k = j+1;
+                invariant = true;
+                break;
+            }
+            Q.col(j+1) = w / Hm(j+1,j);
+        }
+
+        Eigen::ComplexEigenSolver<MatrixXc> ritz(Hm.topLeftCorner(k,k));
+
+        //Complete once every Ritz value inside the circle around the box has
+        //converged and a converged one lies outside it, so the ones inside
+        //aren't just the first few of a cluster that hasn't come through yet
+        bool allInside = true;
+        bool beyond    = false;
+        uint inside    = 0;
+        for (uint i=0; i<k; ++i) {
+            complex  mu = ritz.eigenvalues()(i);
+            VectorXc y  = ritz.eigenvectors().col(i);
+            real residual = std::abs(Hm.row(k).head(k).transpose().cwiseProduct(y).sum());
+            bool converged = mu != complex(0,0) && residual <= tolerance*std::abs(mu);
+
+            if (std::abs(mu)*radius >= 1) {
+                inside++;
+                allInside = allInside && converged;
+            } else if (converged) {
+                beyond = true;
+            }
+        }
+
+        if (k == n || (allInside && beyond)) {
+            for (uint i=0; i<k; ++i) {
+                complex mu = ritz.eigenvalues()(i);
+                if (mu == complex(0,0)) continue;
+
+                complex E = sigma + 1./mu;
+                if (box.contains(E)) found.push_back(E);
+            }
+            return true;
+        }
+
+        //Too many for the kept space, or nothing left to restart from
+        if (invariant || inside >= p) return false;
+
+        //Schur form with the p largest Ritz values leading
+        Eigen::ComplexSchur<MatrixXc> schur(Hm.topLeftCorner(k,k));
+        MatrixXc T = schur.matrixT();
+        MatrixXc Z = schur.matrixU();
+        for (uint i=0; i<p; ++i) {
+            uint best = i;
+            for (uint l=i+1; l<k; ++l) {
+                if (std::abs(T(l,l)) > std::abs(T(best,best))) best = l;
+            }
+            for (uint l=best; l-- > i;) {
+                swapSchur(T,Z,l);
+            }
+        }
+
+        //(H - sigma O)^-1 O Q_k Z_p = Q_k Z_p T_p + q_k+1 b with b = h_k Z_p
+        MatrixXc Qp = Q.leftCols(k)*Z.leftCols(p);
+        MatrixXc b  = Hm.row(k).head(k)*Z.leftCols(p);
+
+        Q.col(p)       = Q.col(k);
+        Q.leftCols(p)  = Qp;
+        Hm.setZero();
+        Hm.topLeftCorner(p,p) = T.topLeftCorner(p,p).triangularView<Eigen::Upper>();
+        Hm.row(p).head(p)     = b;
+        start = p;
+    }
+
+    return false;
+}
+
+//Sign of r that keeps g + r away from cancellation
+static inline complex awayFrom(complex r, complex g)
+{
+    return (std::real(std::conj(g)*r) < 0) ? -r : r;
+}
+
+bool CpuSolver::computeSymmetric(const MatrixXc& H, const MatrixXr& L, std::vector<complex>& eigenvalues)
+{
+    constexpr real eps = std::numeric_limits<real>::epsilon();
+
+    int n = H.rows();
+
+    //C = L^-1 H L^-T, with L real the real and imaginary parts reduce separately
+    MatrixXc C(n,n);
+    C.real() = reduce(H.real(),L);
+    C.imag() = reduce(H.imag(),L);
+
+    //Householder tridiagonalization with complex orthogonal reflectors
+    //P = I - 2vv^T/(v^T v), P^T P = I. All products are bilinear, not
+    //hermitian, and a quasi-null v (v^T v ~ 0) ends it in favor of QZ.
+    VectorXc d(n), e = VectorXc::Zero(n);
+    for (int k=0; k<n-2; ++k) {
+        int m = n-k-1;
+        VectorXc v = C.col(k).tail(m);
+
+        real scale = v.norm();
+        if (scale == 0) {
+            d(k) = C(k,k);
+            e(k) = 0;
+            continue;
+        }
+
+        complex alpha = awayFrom(std::sqrt(v.cwiseProduct(v).sum()), v(0));
+        v(0) += alpha;
+
+        complex vv = v.cwiseProduct(v).sum();
+        if (!(std::abs(vv) > 1e3*eps*v.squaredNorm())) return false;
+
+        auto    A = C.bottomRightCorner(m,m);
+        VectorXc p = (A*v) * (2./vv);
+        VectorXc w = p - v * (v.cwiseProduct(p).sum()/vv);
+        A -= v*w.transpose() + w*v.transpose();
+
+        d(k) = C(k,k);
+        e(k) = -alpha;
+    }
+    for (int k=std::max(0,n-2); k<n; ++k) {
+        d(k) = C(k,k);
+        if (k+1 < n) e(k) = C(k+1,k);
+    }
+
+    //Implicitly shifted QL on the complex symmetric tridiagonal (d,e), as for
+    //the real case with complex rotations c^2 + s^2 = 1
+    for (int l=0; l<n; ++l) {
+        int iter = 0;
+        int m;
+        do {
+            for (m=l; m<n-1; ++m) {
+                real dd = std::abs(d(m)) + std::abs(d(m+1));
+                if (std::abs(e(m)) <= eps*dd) break;
+            }
+            if (m == l) break;
+            if (iter++ == 60) return false;
+
+            complex g = (d(l+1)-d(l)) / (2.*e(l));
+            complex r = std::sqrt(g*g + 1.);
+            g = d(m) - d(l) + e(l)/(g + awayFrom(r,g));
+
+            complex s = 1, c = 1, p = 0;
+            int i;
+            for (i=m-1; i>=l; --i) {
+                complex f = s*e(i);
+                complex b = c*e(i);
+                r = std::sqrt(f*f + g*g);
+                e(i+1) = r;
+
+                if (std::abs(r) <= eps*(std::abs(f)+std::abs(g))) {
+                    if (std::abs(f) > eps*std::abs(g)) return false; //null rotation
+                    d(i+1) -= p;
+                    e(m) = 0;
+                    break;
+                }
+
+                s = f/r;
+                c = g/r;
+                g = d(i+1) - p;
+                r = (d(i)-g)*s + 2.*c*b;
+                p = s*r;
+                d(i+1) = g + p;
+                g = c*r - b;
+            }
+            if (i >= l) continue;
+
+            d(l) -= p;
+            e(l) = g;
+            e(m) = 0;
+        } while (m != l);
+    }
+
+    if (!d.allFinite()) return false;
+
+    eigenvalues.assign(d.data(),d.data()+n);
+    std::sort(eigenvalues.begin(),eigenvalues.end(),[](complex a, complex b) {
+        return a.real() < b.real();
+    });
+
+    return true;
+}
+
+std::vector<complex> CpuSolver::computeQZ(MatrixXc& H, const MatrixXr& O)
+{
+    int n = H.rows();
+    int info;
+
+    QZWorkspace& ws = qzWorkspace;
+    ws.reserve(n);
+
+    std::complex<double>* A = lapackData(H.data(),(size_t)n*n,ws.a);
+    std::complex<double>* B = ws.b.data();
+    Eigen::Map<Eigen::MatrixXcd>(B,n,n) = O.cast<double>().cast<std::complex<double>>();
+
+    zggev_("N","N",&n,fortran(A),&n,fortran(B),&n,fortran(ws.alpha.data()),fortran(ws.beta.data()),
+           nullptr,&n,nullptr,&n,fortran(ws.work.data()),&ws.lwork,ws.rwork.data(),&info);
+
+    std::vector<complex> eigenvalues;
+    for (int i=0; i<n; ++i) {
+        std::complex<double> ev = ws.alpha[i]/ws.beta[i];
+        eigenvalues.push_back(complex(ev.real(),ev.imag()));
+    }
+
+    struct {
+        bool operator()(complex a, complex b) {
+            return a.real() < b.real();
+        }
+    } customLess;
+    std::sort(eigenvalues.begin(),eigenvalues.end(),customLess);
+
+    return eigenvalues;
+}
 
 real CpuSolver::overlap(const CGaussian& A, const CGaussian& B)
 {
@@ -398,133 +1406,290 @@ real CpuSolver::overlap(const CGaussian& A, const CGaussian& B)
     return A.norm*B.norm * q * std::sqrt(q);
 }
 
-complex CpuSolver::kinetic(const CGaussian& A, const CGaussian& B, real over)
+void CpuSolver::assemble(const Basis& basis, MatrixXr& T, MatrixXr& V, MatrixXr& O, uint threads)
 {
-    register constexpr real k = 3./2. * hbar;
+    constexpr uint tileSize = 32;
 
-    MatrixXr C = A.A.selfadjointView<Eigen::Lower>()
-               * (A.A+B.A).inverse()
-               * B.A.selfadjointView<Eigen::Lower>() * system->lambdaM();
+    uint size   = basis.size();
+    uint ntiles = (size+tileSize-1)/tileSize;
 
-    return complex(k*C.trace()*over,0);
-}
+    std::vector<std::pair<uint,uint>> tiles;
+    for (uint I=0; I<ntiles; ++I) {
+        for (uint J=0; J<=I; ++J) {
+            tiles.push_back(std::make_pair(I,J));
+        }
+    }
 
-complex CpuSolver::gaussianV(real v0, real r0, real theta, real over, real c_ij)
-{
-    constexpr real k = pi*sqrt(pi);
+    //Every element is written by exactly one thread so no locking is needed
+    parallelFor(tiles.size(),threads,[&](uint k) {
+        uint mstart = tiles[k].first*tileSize;
+        uint nstart = tiles[k].second*tileSize;
+        uint mend   = std::min(mstart+tileSize,size);
+        uint nend   = std::min(nstart+tileSize,size);
 
-    complex a = complex(1./2.*c_ij,0) + std::exp(complex(0,2*theta)) / complex(2*r0*r0,0);
-    complex integral = complex(v0*k,0) * std::pow(a,-3./2.);
+        for (uint m=mstart; m<mend; ++m) {
+            for (uint n=nstart; n<nend && n<=m; ++n) {
+                element(basis[m],basis[n],T(m,n),V(m,n),O(m,n));
 
-    return std::pow(c_ij/(2*pi), 3./2.) * over * integral;
+                T(n,m) = T(m,n);
+                V(n,m) = V(m,n);
+                O(n,m) = O(m,n);
+            }
+        }
+    });
 }
 
-real CpuSolver::genc_ij(const CGaussian& A, const CGaussian& B, uint i, uint j)
+void CpuSolver::element(const CGaussian& A, const CGaussian& B, real& T, real& V, real& O)
 {
-    MatrixXr C = (A.A+B.A).inverse();
-    VectorXr w_ij = system->omega(i,j);
-    real c_ij = 1./( w_ij.transpose() * C * w_ij );
+    ElementWorkspace& ws = elementWorkspace;
+    ws.reserve(termCount,system->getInteractionPairs().size());
+
+    real* pre = ws.pre.data();
+    real* c   = ws.c.data();
+    cacheElement(A,B,T,O,pre,c);
+
+    //At theta=0, a = c_ij/2 + 1/(2 r0^2) is real and positive
+    uint ngauss = gaussPairs.size();
 
-    return c_ij;
+    V = 0;
+    for (uint idx=0; idx<termCount; ++idx) {
+        real a = c[idx]/2 + gaussR[idx%ngauss];
+        V += pre[idx] / (a*std::sqrt(a));
+    }
 }
 
-std::tuple<Basis,std::vector<int>,uint> CpuSolver::symmetrize(const CGaussian& A)
+void CpuSolver::elementGradient(const CGaussian& A, const CGaussian& B, real& T, real& V, real& O,
+                                real* dT, real* dV, real* dO)
 {
-    struct Group {
-        std::vector<uint> indices;
-        ParticleType type;
-    };
+    const std::vector<InteractionPair>& pairs = system->getInteractionPairs();
 
-    struct Permutation {
-        std::vector<uint> indices;
-        int sign;
-    };
+    const SymmetrizedCG& sym    = *A.sym;
+    const MatrixXr&      lambda = system->lambdaM();
+    const MatrixXr&      W      = system->omegaM();
+    const MatrixXr&      Wi     = system->interactionOmegaM();
 
-    std::vector<Particle*> particles = system->getParticles();
-    uint N = particles.size();
+    constexpr real twopi = 2*pi;
+    constexpr real kpi   = pi*sqrt(pi);
+    uint n = B.A.rows();
 
-    //Identify all the groups
-    std::vector<Group> groups;
+    //Gradients with respect to B.A as matrices G, dX = tr(G dB.A)
+    MatrixXr GT = MatrixXr::Zero(n,n);
+    MatrixXr GV = MatrixXr::Zero(n,n);
+    MatrixXr GO = MatrixXr::Zero(n,n);
 
-    std::set<int> assigned;
-    for (uint k=0; k<N; ++k) {
-        //If this element hasn't been assigned to a group yet, create one and add it
-        if (assigned.find(k) != assigned.end()) continue;
+    T = 0;
+    V = 0;
+    O = 0;
 
-        Group group;
-        group.indices.push_back(k);
-        group.type = particles[k]->type;
+    for (uint k=0; k<sym.images.size(); ++k) {
+        const CGaussian& Ak  = sym.images[k];
+        real             sgn = sym.signs[k]*sym.nperm;
 
-        //find all the other particles with same identicality and add it to group
-        Particle* p1 = particles[k];
-        for (uint l=k+1; l<N; ++l) {
-            Particle* p2 = particles[l];
+        Eigen::LLT<MatrixXr> llt(Ak.A+B.A);
+        MatrixXr Ci  = llt.solve(MatrixXr::Identity(n,n));
+        MatrixXr ACi = Ak.A*Ci;
 
-            if (p1->identicality == p2->identicality) {
-                group.indices.push_back(l);
-                assigned.insert(l);
-            }
+        real det = 1;
+        for (uint i=0; i<n; ++i) {
+            det *= llt.matrixLLT()(i,i)*llt.matrixLLT()(i,i);
         }
+        real q  = std::pow(twopi,n)/det;
+        real ol = sgn * Ak.norm*B.norm * q * std::sqrt(q);
 
-        groups.push_back(group);
-    }
+        //d ln ol = -3/2 tr(C^-1 dB) with C = A+B, B's norm is added below
+        MatrixXr Gol = -1.5*Ci;
 
-    //Permute the particles in each group
-    Permutation defaultPerm;
-    defaultPerm.sign = 1;
-    defaultPerm.indices.resize(N);
-    for (uint k=0; k<N; ++k)
-        defaultPerm.indices[k]=k;
+        //d tr(C^-1 B Lambda A) = tr(C^-1 A Lambda A C^-1 dB)
+        real     kin  = 1.5*hbar * (Ci*B.A*lambda*Ak.A).trace();
+        MatrixXr Gkin = 1.5*hbar * ACi.transpose()*lambda*ACi;
 
-    std::vector<Permutation> permutations;
-    permutations.push_back(defaultPerm);
+        O  += ol;
+        GO += ol*Gol;
+        T  += kin*ol;
+        GT += ol*(Gkin + kin*Gol);
 
-    for (Group group : groups) {
-        int sign = 1;
-        Group gperm = group;
-        while (std::next_permutation(gperm.indices.begin(),gperm.indices.end())) {
-            if (group.type == ParticleType::PT_Fermion) sign *= -1;
+        //c_ij = 1/(w^T C^-1 w), dc_ij = c_ij^2 (C^-1 w)^T dB (C^-1 w)
+        for (uint g=0; g<gaussPairs.size(); ++g) {
+            const InteractionPair& inter = pairs[gaussPairs[g]];
 
-            Permutation perm;
-            perm.sign = sign;
-            perm.indices.resize(N);
+            VectorXr y = Ci*Wi.col(gaussPairs[g]);
+            real     c = 1/Wi.col(gaussPairs[g]).dot(y);
+            real     a = c/2 + gaussR[g];
+            real     v = inter.v0*kpi * std::pow(c/(2*pi),3./2.) * ol / (a*std::sqrt(a));
 
-            uint gindex = 0;
-            for (uint n=0; n<N; ++n) {
-                if (n == group.indices[gindex]) {
-                    perm.indices[n] = gperm.indices[gindex];
-                    gindex++;
-                } else {
-                    perm.indices[n] = n;
-                }
-            }
+            V  += v;
+            GV += v*(Gol + (1.5/c - 0.75/a)*c*c*y*y.transpose());
+        }
+    }
 
-            permutations.push_back(perm);
+    //B's norm (det 2B)^3/4 scales every term, d ln norm = 3/4 tr(B^-1 dB)
+    MatrixXr Binv = B.A.inverse();
+    GT += 0.75*T*Binv;
+    GV += 0.75*V*Binv;
+    GO += 0.75*O*Binv;
+
+    //B.A = W diag(1/r_ij^2) W^T, so dB.A/d ln r_ij = -2/r_ij^2 w_ij w_ij^T
+    uint N = B.widths.rows();
+    uint p = 0;
+    for (uint i=0; i<N; ++i) {
+        for (uint j=0; j<i; ++j, ++p) {
+            real f = -2/(B.widths(i,j)*B.widths(i,j));
+            dT[p] = f*W.col(p).dot(GT*W.col(p));
+            dV[p] = f*W.col(p).dot(GV*W.col(p));
+            dO[p] = f*W.col(p).dot(GO*W.col(p));
         }
     }
+}
 
-    //Operate permutations on matrices
-    Basis symA;
-    std::vector<int> signs;
+void CpuSolver::cacheElement(const CGaussian& A, const CGaussian& B,
+                             real& T, real& O, real* pre, real* c)
+{
+    const std::vector<InteractionPair>& pairs = system->getInteractionPairs();
 
-    for (auto perm : permutations) {
-        MatrixXr P;
-        P.resize(N,N);
-        for (uint i=0; i<N; ++i) {
-            for (uint j=0; j<=i; ++j) {
-                P(i,j) = A.widths(perm.indices[i],perm.indices[j]);
-                P(j,i) = P(i,j);
-            }
+    const SymmetrizedCG&    sym   = *A.sym;
+    const Basis&            A_sym = sym.images;
+    const std::vector<int>& signs = sym.signs;
+    uint                    nperm = sym.nperm;
+
+    constexpr real kpi = pi*sqrt(pi);
+
+    T = 0;
+    O = 0;
+
+    ElementWorkspace& ws = elementWorkspace;
+    ws.reserve(0,pairs.size());
+
+    PairTerms terms;
+    terms.c = ws.pairC.data();
+    uint idx = 0;
+    for (uint k=0; k<A_sym.size(); ++k) {
+        (this->*kernel)(A_sym[k],B,terms);
+
+        real sgn = signs[k]*nperm;
+        real ol  = terms.ol;
+
+        O += sgn * ol;
+        T += sgn * 3./2.*hbar * terms.kin * ol;
+
+        for (uint g=0; g<gaussPairs.size(); ++g, ++idx) {
+            const InteractionPair& inter = pairs[gaussPairs[g]];
+            real c_ij = terms.c[gaussPairs[g]];
+
+            c[idx]   = c_ij;
+            pre[idx] = sgn * inter.v0*kpi * std::pow(c_ij/(2*pi),3./2.) * ol;
         }
+    }
+}
+
+complex CpuSolver::rotatedV(const real* pre, const real* c, real theta)
+{
+    complex phase = std::exp(complex(0,2*theta));
+    uint    ngauss = gaussPairs.size();
+
+    //a^-3/2 with a = c_ij/2 + e^(2i theta)/(2 r0^2)
+    complex V = 0;
+    for (uint idx=0; idx<termCount; ++idx) {
+        complex a = complex(c[idx]/2,0) + phase*gaussR[idx%ngauss];
+        V += pre[idx] / (a*std::sqrt(a));
+    }
+
+    return V;
+}
+
+complex CpuSolver::rotatedDV(const real* pre, const real* c, real theta)
+{
+    complex phase = std::exp(complex(0,2*theta));
+    uint    ngauss = gaussPairs.size();
+
+    //d/dtheta a^-3/2 = -3/2 a^-5/2 * 2i e^(2i theta)/(2 r0^2)
+    complex dV = 0;
+    for (uint idx=0; idx<termCount; ++idx) {
+        complex da = complex(0,2)*phase*gaussR[idx%ngauss];
+        complex a  = complex(c[idx]/2,0) + phase*gaussR[idx%ngauss];
+        dV += -1.5*pre[idx]*da / (a*a*std::sqrt(a));
+    }
 
-        CGaussian cg;
-        cg.widths = P;
-        MatrixStrain::computeCG(&cg,system);
+    return dV;
+}
 
-        symA.push_back(cg);
-        signs.push_back(perm.sign);
+complex CpuSolver::rotatedElement(const Basis& basis, uint m, uint n, real theta, bool derivative,
+                                  real& T, real& O)
+{
+    const real* pre;
+    const real* c;
+
+    if (rotCached) {
+        size_t e = packed(m,n);
+        T   = rotT[e];
+        O   = rotO[e];
+        pre = &rotPre[e*termCount];
+        c   = &rotC[e*termCount];
+    } else {
+        ElementWorkspace& ws = elementWorkspace;
+        ws.reserve(termCount,system->getInteractionPairs().size());
+
+        cacheElement(basis[m],basis[n],T,O,ws.pre.data(),ws.c.data());
+        pre = ws.pre.data();
+        c   = ws.c.data();
     }
 
-    return std::make_tuple(symA,signs,permutations.size());
+    return derivative ? rotatedDV(pre,c,theta) : rotatedV(pre,c,theta);
 }
 
+MatrixXc CpuSolver::rotatedVMatrix(const Basis& basis, real theta, bool derivative, uint threads)
+{
+    uint size = basis.size();
+    MatrixXc out(size,size);
+
+    //Pure arithmetic on the cached terms, rows are handed out largest first
+    parallelFor(size,threads,[&](uint k) {
+        uint m = size-1-k;
+        for (uint n=0; n<=m; ++n) {
+            real T, O;
+            out(m,n) = out(n,m) = rotatedElement(basis,m,n,theta,derivative,T,O);
+        }
+    });
+
+    return out;
+}
+
+template<int D>
+void CpuSolver::pairKernel(const CGaussian& A, const CGaussian& B, PairTerms& out)
+{
+    //Fixed size for D != Dynamic, so nothing here touches the heap
+    constexpr int P = (D == Eigen::Dynamic) ? Eigen::Dynamic : D*(D+1)/2;
+    typedef Eigen::Matrix<real,D,D>                           MatrixDr;
+    typedef Eigen::Matrix<real,D,Eigen::Dynamic,0,D,P>        MatrixDPr;
+
+    const std::vector<InteractionPair>& pairs = system->getInteractionPairs();
+
+    constexpr real twopi = 2*pi;
+    uint n = A.A.rows();
+
+    const MatrixDr a = A.A;
+    const MatrixDr b = B.A;
+    const MatrixDr lambda = system->lambdaM();
+
+    //A+B is symmetric positive definite, so one Cholesky factor C = LL^T
+    //gives the determinant, the kinetic trace and every c_ij
+    Eigen::LLT<MatrixDr> llt(a+b);
+    const MatrixDr& LLT = llt.matrixLLT();
+
+    real det = 1;
+    for (uint k=0; k<n; ++k) {
+        det *= LLT(k,k)*LLT(k,k);
+    }
+    real q = std::pow(twopi,n)/det;
+    out.ol = A.norm*B.norm * q * std::sqrt(q);
+
+    //tr(A (A+B)^-1 B Lambda) = tr((A+B)^-1 B Lambda A)
+    MatrixDr BLA = b * lambda * a;
+    out.kin = llt.solve(BLA).trace();
+
+    //c_ij = 1/(w^T (A+B)^-1 w) = 1/|L^-1 w|^2, all interacting pairs at once
+    MatrixDPr Y = system->interactionOmegaM();
+    llt.matrixL().solveInPlace(Y);
+    for (uint p=0; p<pairs.size(); ++p) {
+        out.c[p] = 1./Y.col(p).squaredNorm();
+    }
+}
@@ -5,14 +5,54 @@
 #include <tuple>
 #include "typedefs.h"
 #include "system.h"
+#include "threadpool.h"
+
+//Box in the complex energy plane
+struct EnergyWindow
+{
+    real reMin, reMax;
+    real imMin, imMax;
+
+    bool contains(complex E) const {
+        return E.real() >= reMin && E.real() <= reMax &&
+               E.imag() >= imMin && E.imag() <= imMax;
+    }
+};
 
 struct SolverResults
 {
-    MatrixXc T;
-    MatrixXc V;
+    //Unrotated and real symmetric, the rotated kinetic term is e^(-2i theta) T
+    MatrixXr T;
+    MatrixXr V;
     MatrixXr O;
+    MatrixXr L;    //Cholesky factor O = LL^T, grown a row at a time by solveRow
+    MatrixXr Hs;   //L^-1 (T+V) L^-T, grown along with L
+    MatrixXc Vrot; //V(theta), only filled by the rotated solves
     std::vector<complex>  eigenvalues;
-    std::vector<VectorXc> eigenvectors;
+    std::vector<VectorXr> eigenvectors; //O-normalized, unrotated solves only
+
+    //Rotated solves with rotVectors: right eigenvectors of eigenvalues[selected[k]],
+    //normalized as x^T O x = 1 (no conjugation)
+    std::vector<uint>     selected;
+    std::vector<VectorXc> rotEigenvectors;
+};
+
+//The unrotated elements between one function and every function of a basis
+struct SolverRow
+{
+    VectorXr T;
+    VectorXr V;
+    VectorXr O;
+};
+
+//Derivatives of a trial's SolverRow with respect to the logarithms of its
+//widths, column m belongs to entry m of the row and row p to the pair
+//(i,j) i>j that is p-th in MatrixStrain::computeCG order
+struct SolverRowGradient
+{
+    MatrixXr T;
+    MatrixXr V;
+    MatrixXr O;
 };
 
 class Solver
@@ -21,22 +61,123 @@ public:
     Solver(System*);
     virtual ~Solver();
 
-    //Compute and solve for ALL the Hamiltonian elements.
-    virtual SolverResults solve(const Basis&)=0;
+    //Compute and solve for ALL the Hamiltonian elements, spread over threads.
+    virtual SolverResults solve(const Basis&, uint threads)=0;
+
+    //Update/add row to already computed Hamiltonian/eigenvalues. threads > 1
+    //splits the row itself, for when there are fewer concurrent rows than cores
+    virtual SolverResults solveRow(const Basis&, const SolverResults& cache, uint row, uint threads)=0;
+
+    //Same as above with the row already computed by computeRow
+    virtual SolverResults solveRow(const SolverResults& cache, const SolverRow&, uint row)=0;
+
+    //Appends several functions at once, rows[j] holds the elements with the
+    //basis of cache, with the functions of rows[0..j-1] and with itself
+    virtual SolverResults solveRows(const SolverResults& cache, const std::vector<SolverRow>& rows)=0;
+
+    //Elements between basis[row] and every function of the basis
+    virtual SolverRow computeRow(const Basis&, uint row, uint threads)=0;
+
+    //Elements between trial and every function of the basis, and trial itself
+    //last: the row trial would have appended to the basis, without copying it
+    virtual SolverRow computeRow(const Basis&, const CGaussian& trial, uint threads)=0;
 
-    //Update/add row to already computed Hamiltonian/eigenvalues
-    virtual SolverResults solveRow(const Basis&, SolverResults& cache, uint row)=0;
+    //Same as above, also filling the derivatives of the row
+    virtual SolverRow computeRow(const Basis&, const CGaussian& trial, SolverRowGradient&, uint threads)=0;
+
+    //Results for the basis of cache without function row, against which
+    //screenRow scores functions that would replace it. The Cholesky factor
+    //is downdated in O(n^2), the standard form is diagonalized densely even
+    //when iterative, so that the screened energies are exact.
+    virtual SolverResults removeRow(const SolverResults& cache, uint row)=0;
+
+    //Squared norm of the new function's component orthogonal to the basis of
+    //cache, relative to its own: l_nn^2/o_nn with the Cholesky row solveRow
+    //would add. Small values mean linear dependence.
+    virtual real orthogonality(const SolverResults& cache, const SolverRow&)=0;
+
+    //Estimates eigenvalue target after appending the function of a computed row
+    //to the basis of cache, from the roots of the secular equation of the
+    //bordered matrix. O(n^2) instead of a full diagonalization. Returns NaN if
+    //the function is linearly dependent on the basis.
+    virtual complex screenRow(const SolverResults& cache, const SolverRow&, uint target)=0;
+
+    //Same as above, also the gradient of the estimate with the derivatives of
+    //the row, by first order perturbation of the bordered eigenproblem
+    virtual complex screenRow(const SolverResults& cache, const SolverRow&, uint target,
+                              const SolverRowGradient&, VectorXr& gradient)=0;
 
     //Compute and solve for a complex rotation. Requires unrotated cache;
-    virtual SolverResults solveRot(const Basis&, real theta, SolverResults& unrot)=0;
+    virtual SolverResults solveRot(const Basis&, real theta, SolverResults& unrot, uint threads)=0;
+
+    //Caches the theta independent terms of every element not yet cached for
+    //this basis, if the whole cache fits in rotCacheMB. Must be called (not
+    //concurrently) before solveRot/solveRotRow whenever the basis changed.
+    virtual void prepareRot(const Basis&, uint threads)=0;
 
     //Update/add rot to already computed rotated Hamiltonian/eigenvalues;
-    virtual SolverResults solveRotRow(const Basis&, real theta, SolverResults& cache, uint row)=0;
+    virtual SolverResults solveRotRow(const Basis&, real theta, SolverResults& cache, uint row, uint threads)=0;
+
+    //Appends the functions from first on to a rotated solve of the basis
+    //before them: all their rows are filled, then solved once
+    virtual SolverResults solveRotRows(const Basis&, real theta, SolverResults& cache, uint first, uint threads)=0;
+
+    //Follows the selected eigenvalues of prev, a rotated solve at prevTheta with
+    //rotVectors, to theta: a first order prediction from dH/dtheta refined by
+    //shift-invert Rayleigh quotient iteration. The results hold only those
+    //eigenvalues, all selected with their eigenvectors.
+    virtual SolverResults continueRot(const Basis&, real theta, const SolverResults& prev,
+                                      real prevTheta, uint threads)=0;
+
+    //Right eigenvector of a rotated solve for its eigenvalue E, by inverse
+    //iteration on H(theta) - E O
+    virtual VectorXc rotEigenvector(const SolverResults& rot, real theta, complex E)=0;
 
     virtual real overlap(const CGaussian&, const CGaussian&)=0;
 
+    //Only the lowest numStates eigenpairs of the unrotated solves by a Davidson
+    //iteration, warm started from the cache eigenvectors in solveRow. Results
+    //then hold numStates eigenpairs, or all of them where the iteration fell
+    //back to the dense solve. The matrices are always complete.
+    bool iterative;
+    uint numStates;
+
+    //Rotated eigenvalues from a complex symmetric tridiagonal QL in the standard
+    //form L^-1 H L^-T instead of QZ on the pencil, falling back to QZ on breakdown
+    bool complexSymmetric;
+
+    //Rotated solves also return the eigenvectors of the eigenvalues in vectorWindow
+    bool         rotVectors;
+    EnergyWindow vectorWindow;
+
+    //Rotated solves only return the eigenvalues in sliceWindow, found by
+    //shift-invert Arnoldi on slices of it that run in parallel
+    bool         slicing;
+    EnergyWindow sliceWindow;
+    uint         slices;
+
+    //Memory budget of the prepareRot cache in MB. Larger bases, or 0, recompute
+    //every element at every angle instead.
+    real rotCacheMB;
+
+    //Pool the threads arguments are taken from, without one everything is serial
+    void setThreadPool(ThreadPool* p) { pool = p; }
+
 protected:
-    System*  system;
+    System*     system;
+    ThreadPool* pool;
+
+    template<typename F>
+    void parallelFor(uint count, uint threads, const F& work)
+    {
+        if (pool) {
+            pool->parallelFor(count,threads,work);
+        } else {
+            for (uint k=0; k<count; ++k) {
+                work(k);
+            }
+        }
+    }
 };
 
 class CpuSolver : public Solver
@@ -45,24 +186,123 @@ public:
     CpuSolver(System*);
     ~CpuSolver();
 
-    SolverResults solve(const Basis&);
-    SolverResults solveRow(const Basis&, SolverResults& cache, uint row);
-    SolverResults solveRot(const Basis&, real theta, SolverResults& unrot);
-    SolverResults solveRotRow(const Basis&, real theta, SolverResults& cache, uint row);
+    SolverResults solve(const Basis&, uint threads);
+    SolverResults solveRow(const Basis&, const SolverResults& cache, uint row, uint threads);
+    SolverResults solveRow(const SolverResults& cache, const SolverRow&, uint row);
+    SolverResults solveRows(const SolverResults& cache, const std::vector<SolverRow>& rows);
+    SolverRow     computeRow(const Basis&, uint row, uint threads);
+    SolverRow     computeRow(const Basis&, const CGaussian& trial, uint threads);
+    SolverRow     computeRow(const Basis&, const CGaussian& trial, SolverRowGradient&, uint threads);
+    SolverResults removeRow(const SolverResults& cache, uint row);
+    real          orthogonality(const SolverResults& cache, const SolverRow&);
+    complex       screenRow(const SolverResults& cache, const SolverRow&, uint target);
+    complex       screenRow(const SolverResults& cache, const SolverRow&, uint target,
+                            const SolverRowGradient&, VectorXr& gradient);
+    SolverResults solveRot(const Basis&, real theta, SolverResults& unrot, uint threads);
+    SolverResults solveRotRow(const Basis&, real theta, SolverResults& cache, uint row, uint threads);
+    SolverResults solveRotRows(const Basis&, real theta, SolverResults& cache, uint first, uint threads);
+    void          prepareRot(const Basis&, uint threads);
+    SolverResults continueRot(const Basis&, real theta, const SolverResults& prev,
+                              real prevTheta, uint threads);
+    VectorXc      rotEigenvector(const SolverResults& rot, real theta, complex E);
 
     real overlap(const CGaussian&, const CGaussian&);
 
 private:
-    complex kinetic  (const CGaussian&, const CGaussian&, real);
-    complex gaussianV(real v0, real r0, real theta, real over, real c_ij);
+    //Theta independent pieces of one permuted matrix element
+    struct PairTerms {
+        real ol;             //overlap
+        real kin;            //tr(A (A+B)^-1 B Lambda)
+        real* c;             //c_ij for every interacting pair, caller's storage
+    };
+
+    //Fills the unrotated T, V and O for the whole basis, with the lower
+    //triangle split into tiles that are handed out to threads
+    void assemble(const Basis&, MatrixXr& T, MatrixXr& V, MatrixXr& O, uint threads);
+
+    //Elements between cg and every function of the basis into the leading
+    //entries of r, in chunks handed out to threads
+    void fillRow(const Basis&, const CGaussian& cg, SolverRow& r, uint threads);
+
+    //Symmetrized unrotated T, V and O elements between two basis functions
+    void element(const CGaussian&, const CGaussian&, real& T, real& V, real& O);
+
+    //element() and the derivatives of T, V and O with respect to the logarithms
+    //of B's widths, A is held fixed. Not on the hot path, so dynamic sized.
+    void elementGradient(const CGaussian& A, const CGaussian& B, real& T, real& V, real& O,
+                         real* dT, real* dV, real* dO);
+
+    //Both screenRow overloads, grad and gradient may be null
+    complex screen(const SolverResults& cache, const SolverRow&, uint target,
+                   const SolverRowGradient* grad, VectorXr* gradient);
+
+    //Theta independent part of an element: T, O, and per permutation and
+    //gaussian pair the prefactor sign*nperm*v0*pi^3/2*(c_ij/2pi)^3/2*overlap and c_ij
+    void cacheElement(const CGaussian&, const CGaussian&,
+                      real& T, real& O, real* pre, real* c);
+
+    //V at theta from the cached terms of one element, and its theta derivative
+    complex rotatedV(const real* pre, const real* c, real theta);
+    complex rotatedDV(const real* pre, const real* c, real theta);
+
+    //V(theta) or dV/dtheta of element (m,n), with its T and O, from the
+    //prepareRot cache or recomputed when there is none
+    complex rotatedElement(const Basis&, uint m, uint n, real theta, bool derivative,
+                           real& T, real& O);
+
+    //V(theta) for the whole basis, element by element as above
+    MatrixXc rotatedVMatrix(const Basis&, real theta, bool derivative, uint threads);
+
+    //Evaluates overlap, kinetic and all pair terms from one factorization of A+B.
+    //D is the number of Jacobi coordinates, fixed sizes are instantiated for
+    //2 to 6 particles and Eigen::Dynamic is used for anything larger
+    template<int D>
+    void pairKernel(const CGaussian&, const CGaussian&, PairTerms&);
+
+    //pairKernel specialization for the particle count, chosen on construction
+    void (CpuSolver::*kernel)(const CGaussian&, const CGaussian&, PairTerms&);
+
+    //Interaction pair list indices of the gaussian pairs, and their 1/(2 r0^2)
+    std::vector<uint> gaussPairs;
+    std::vector<real> gaussR;
+    uint              termCount; //permutations * gaussian pairs
 
-    real genc_ij(const CGaussian& A, const CGaussian& B, uint i, uint j);
+    //Theta independent terms from prepareRot, element (m,n) m>=n is at
+    //m(m+1)/2+n in rotT/rotO and at termCount times that in rotPre/rotC
+    std::vector<real> rotT;
+    std::vector<real> rotO;
+    std::vector<real> rotPre;
+    std::vector<real> rotC;
+    std::vector<std::shared_ptr<const SymmetrizedCG>> rotFuncs;
+    bool              rotCached; //false if the last prepareRot was over budget
 
-    SolverResults computeHermition(MatrixXc& T, MatrixXc& V, MatrixXr& O);
-    SolverResults computeQZ(MatrixXc& T, MatrixXc& V, MatrixXr& O);
-    //SolverResults computeRF(MatrixXc& T, MatrixXc& V, MatrixXr& O, const Basis&, SolverResults& uplft);
+    //Real symmetric-definite eigenproblem of the unrotated Hamiltonian,
+    //reduced to the standard form Hs with the Cholesky factor L of O
+    SolverResults computeHermition(MatrixXr& T, MatrixXr& V, MatrixXr& O, MatrixXr& L, MatrixXr& Hs);
+    //Lowest numStates eigenpairs of the same problem, starting from the
+    //eigenvectors of guess (zero padded if it is smaller) and the unit vector of row.
+    //Falls back to computeHermition if the iteration does not converge.
+    SolverResults computeDavidson(MatrixXr& T, MatrixXr& V, MatrixXr& O, MatrixXr& L, MatrixXr& Hs,
+                                  const SolverResults& guess, uint row);
+    //Whether solves of a basis of size go through computeDavidson
+    bool useDavidson(uint size) const;
+    //Fills selected and rotEigenvectors of a rotated solve from vectorWindow
+    void selectVectors(SolverResults& rot, real theta);
 
-    std::tuple<Basis,std::vector<int>,uint> symmetrize(const CGaussian&);
+    //Eigenvalues of the rotated, complex symmetric pencil (H,O) with O = LL^T,
+    //by slicing, computeSymmetric or QZ, whichever is enabled. H is overwritten.
+    std::vector<complex> computeRotated(MatrixXc& H, const MatrixXr& O, const MatrixXr& L, uint threads);
+    //Eigenvalues in sliceWindow, boxes that may have missed some are split and
+    //the ones still incomplete after maxDepth splits are solved by QZ
+    std::vector<complex> computeSlices(const MatrixXc& H, const MatrixXr& O, uint threads);
+    //Eigenvalues in box from Krylov-Schur restarted shift-invert Arnoldi at its
+    //center. False unless every Ritz value in the circle around the box has
+    //converged and a converged one lies beyond it, so none can be missing.
+    bool sliceEigenvalues(const MatrixXc& H, const MatrixXc& O, const EnergyWindow& box,
+                          std::vector<complex>& found);
+    //False if the complex orthogonal reduction broke down
+    bool computeSymmetric(const MatrixXc& H, const MatrixXr& L, std::vector<complex>& eigenvalues);
+    std::vector<complex> computeQZ(MatrixXc& H, const MatrixXr& O);
 };
 
 #endif
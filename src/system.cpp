@@ -1,4 +1,6 @@
+#include <set>
 #include <numeric>
+#include <algorithm>
 #include "system.h"
 
 System::System()
@@ -52,6 +54,101 @@ void System::init()
     }
 
     lambdaMatrix = L;
+
+    //Generate the omega matrix and compile the interacting pairs
+    omegaMatrix.resize(N-1,N*(N-1)/2);
+    interactionPairs.clear();
+
+    int p = 0;
+    for (int i=0; i<N; ++i) {
+        for (int j=0; j<i; ++j, ++p) {
+            omegaMatrix.col(p) = omega(i,j);
+
+            const InteractionV& inter = getInteraction(particles[i]->name,particles[j]->name);
+            if (inter.type == InteractionV::None) continue;
+
+            InteractionPair pair;
+            pair.i     = i;
+            pair.j     = j;
+            pair.type  = inter.type;
+            pair.v0    = inter.v0;
+            pair.r0    = inter.r0;
+            pair.index = p;
+
+            interactionPairs.push_back(pair);
+        }
+    }
+
+    interactionOmega.resize(N-1,interactionPairs.size());
+    for (uint k=0; k<interactionPairs.size(); ++k) {
+        interactionOmega.col(k) = omegaMatrix.col(interactionPairs[k].index);
+    }
+
+    //Generate the permutations of identical particles
+    struct Group {
+        std::vector<uint> indices;
+        ParticleType type;
+    };
+
+    //Identify all the groups
+    std::vector<Group> groups;
+
+    std::set<int> assigned;
+    for (int k=0; k<N; ++k) {
+        //If this element hasn't been assigned to a group yet, create one and add it
+        if (assigned.find(k) != assigned.end()) continue;
+
+        Group group;
+        group.indices.push_back(k);
+        group.type = particles[k]->type;
+
+        //find all the other particles with same identicality and add it to group
+        Particle* p1 = particles[k];
+        for (int l=k+1; l<N; ++l) {
+            Particle* p2 = particles[l];
+
+            if (p1->identicality == p2->identicality) {
+                group.indices.push_back(l);
+                assigned.insert(l);
+            }
+        }
+
+        groups.push_back(group);
+    }
+
+    //Permute the particles in each group
+    Permutation defaultPerm;
+    defaultPerm.sign = 1;
+    defaultPerm.indices.resize(N);
+    for (int k=0; k<N; ++k)
+        defaultPerm.indices[k]=k;
+
+    permutations.clear();
+    permutations.push_back(defaultPerm);
+
+    for (Group group : groups) {
+        int sign = 1;
+        Group gperm = group;
+        while (std::next_permutation(gperm.indices.begin(),gperm.indices.end())) {
+            if (group.type == ParticleType::PT_Fermion) sign *= -1;
+
+            Permutation perm;
+            perm.sign = sign;
+            perm.indices.resize(N);
+
+            uint gindex = 0;
+            for (int n=0; n<N; ++n) {
+                if (gindex < group.indices.size() && (uint)n == group.indices[gindex]) {
+                    perm.indices[n] = gperm.indices[gindex];
+                    gindex++;
+                } else {
+                    perm.indices[n] = n;
+                }
+            }
+
+            permutations.push_back(perm);
+        }
+    }
 }
 
 void System::addParticle(Particle* p)
@@ -116,6 +213,26 @@ const MatrixXr& System::lambdaM()
     return lambdaMatrix;
 }
 
+const MatrixXr& System::omegaM()
+{
+    return omegaMatrix;
+}
+
+const MatrixXr& System::interactionOmegaM()
+{
+    return interactionOmega;
+}
+
+const std::vector<InteractionPair>& System::getInteractionPairs()
+{
+    return interactionPairs;
+}
+
+const std::vector<Permutation>& System::getPermutations()
+{
+    return permutations;
+}
+
 const VectorXr System::omega(uint i, uint j)
 {
     uint N = particles.size();
@@ -34,6 +34,21 @@ struct InteractionV {
     real r0  = 1;
 };
 
+//An interacting particle pair, compiled from the interaction table by System::init
+struct InteractionPair {
+    uint i;
+    uint j;
+    InteractionV::Type type;
+    real v0;
+    real r0;
+    uint index; //column in System::omegaM()
+};
+
+struct Permutation {
+    std::vector<uint> indices;
+    int sign;
+};
+
 class System
 {
     public:
@@ -59,18 +74,34 @@ class System
 
     const VectorXr omega(uint,uint);
 
+    //omega(i,j) for every pair i>j as columns, pair (i,j) is column i(i-1)/2+j
+    const MatrixXr& omegaM();
+    //The columns of omegaM() for the interacting pairs, in pair list order
+    const MatrixXr& interactionOmegaM();
+
+    //Only the pairs with an interaction other than None
+    const std::vector<InteractionPair>& getInteractionPairs();
+
+    //All permutations of identical particles, identity first
+    const std::vector<Permutation>& getPermutations();
+
     private:
     MatrixXr jacobiTransformMatrix;
     MatrixXr jacobiTM_inv;
     MatrixXr lambdaMatrix;
+    MatrixXr omegaMatrix;
+    MatrixXr interactionOmega;
 
     std::vector<Particle*> particles;
+    std::vector<Permutation> permutations;
 
     std::unordered_map<
         std::pair<std::string,std::string>,
         InteractionV
     > interactionPotentials;
 
+    std::vector<InteractionPair> interactionPairs;
+
     InteractionV trappingPotential;
 };
 
@@ -0,0 +1,49 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(uint threads)
+    : stop(false)
+{
+    for (uint i=1; i<threads; ++i) {
+        workers.push_back(std::thread([this]() {
+            helpUntil([this]() { return stop; });
+        }));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        wake.notify_all();
+    }
+
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+    wake.notify_one();
+}
+
+void ThreadPool::helpUntil(const std::function<bool()>& done)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (!done()) {
+        if (!tasks.empty()) {
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+
+            lock.unlock();
+            task();
+            lock.lock();
+        } else {
+            wake.wait(lock);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include "typedefs.h"
+
+//Long lived workers shared by basis generation, sweeps and the solver. The
+//thread that waits on a parallelFor runs queued tasks meanwhile, so nested
+//parallelFor calls from inside tasks don't deadlock or idle a core.
+class ThreadPool
+{
+public:
+    //threads counts the calling thread, threads-1 workers are started
+    ThreadPool(uint threads);
+    ~ThreadPool();
+
+    uint size() const { return workers.size()+1; }
+
+    //Runs work(k) for every k in [0,count) on up to threads of the pool's
+    //threads, the caller included, and returns when all of them are done.
+    //Indices are claimed from a shared counter, so uneven work balances itself.
+    template<typename F>
+    void parallelFor(uint count, uint threads, const F& work);
+
+private:
+    std::vector<std::thread>          workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex                        mutex;
+    std::condition_variable           wake; //new tasks and finished helpers
+    bool                              stop;
+
+    void submit(std::function<void()> task);
+
+    //Runs queued tasks until done() holds, done() is called with mutex held
+    void helpUntil(const std::function<bool()>& done);
+};
+
+template<typename F>
+void ThreadPool::parallelFor(uint count, uint threads, const F& work)
+{
+    threads = std::min(std::min(threads,size()),count);
+
+    if (threads <= 1) {
+        for (uint k=0; k<count; ++k) {
+            work(k);
+        }
+        return;
+    }
+
+    std::atomic<uint> next(0);
+    uint finished = 0; //helpers done, guarded by mutex
+
+    auto run = [&]() {
+        for (uint k=next++; k<count; k=next++) {
+            work(k);
+        }
+    };
+
+    for (uint i=1; i<threads; ++i) {
+        submit([&]() {
+            run();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            ++finished;
+            wake.notify_all();
+        });
+    }
+    run();
+
+    helpUntil([&]() { return finished == threads-1; });
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include <iostream>
 #include <complex>
 #include <vector>
+#include <memory>
 #include <thread>
 #include <eigen3/Eigen/Dense>
 
@@ -29,67 +30,32 @@ typedef Eigen::Matrix<complex,-1,-1> MatrixXc;
 typedef Eigen::Matrix<real,-1,1>     VectorXr;
 typedef Eigen::Matrix<complex,-1,1>  VectorXc;
 
+struct SymmetrizedCG;
+
 typedef struct {
     MatrixXr A;
     MatrixXr widths;
     real norm;
     uint strain;
+
+    //Permuted images, shared between all copies of the function
+    std::shared_ptr<const SymmetrizedCG> sym;
 } CGaussian;
 
 typedef std::vector<CGaussian> Basis;
 
+//Images of a CGaussian under every permutation of identical particles,
+//built once per function by MatrixStrain::symmetrize
+struct SymmetrizedCG {
+    Basis images;
+    std::vector<int> signs;
+    uint nperm;
+};
+
 constexpr real pi    = 3.141592653589793238462643383279502884197169399375105820974944592307816406286;
 constexpr real twopi = 2*pi;
 constexpr real hbar  = 1;
 
-//Wrapper to make a function return to a pointer supplied as an argument
-//if NOT member function pointer
-template<typename F, typename T, typename... P>
-typename std::enable_if<!std::is_member_function_pointer<F>::value>::type
-    void_wrapper(F func, T* out, P... params)
-{
-    *out = (*func)(params...);
-}
-
-//if member function pointer
-template<typename F, typename T, typename... P>
-typename std::enable_if<std::is_member_function_pointer<F>::value>::type
-    void_wrapper(F func, T* out, P... params)
-{
-    void_member_wrapper(func, out, params...);
-}
-
-//Same thing for member functions
-template<class C, typename F, typename T, typename... P>
-void void_member_wrapper(F C::* func, T* out, C* c, P... params)
-{
-    *out = (c->*func)(params...);
-}
-
-//Take a function returning non-void and run it as a thread, with
-//output directed through a pointer
-//if NOT member function pointer
-template<typename F, typename T, typename... P>
-typename std::enable_if<!std::is_member_function_pointer<F>::value, std::thread>::type
-    threadify(F func, T* out, P... params)
-{
-    return std::thread(void_wrapper<F,T,P...>,func,out,params...);
-}
-
-//if member function pointer
-template<typename F, typename T, typename... P>
-typename std::enable_if<std::is_member_function_pointer<F>::value, std::thread>::type
-    threadify(F func, T* out, P... params)
-{
-    return threadify_member(func, out, params...);
-}
-
-template<class C, typename F, typename T, typename... P>
-std::thread threadify_member(F C::* func, T* out, C* c, P... params)
-{
-    return std::thread(void_member_wrapper<C,F,T,P...>,func,out,c,params...);
-}
-
 namespace std {
 
     template<>